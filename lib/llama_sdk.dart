@@ -4,6 +4,7 @@ import 'dart:async';
 import 'dart:convert';
 import 'dart:ffi' as ffi;
 import 'dart:isolate';
+import 'dart:typed_data';
 
 import 'package:ffi/ffi.dart';
 
@@ -15,8 +16,13 @@ export 'src/shared/llama_message.dart';
 import 'src/shared/llama_controller.dart';
 export 'src/shared/llama_controller.dart';
 
+import 'src/shared/llama_exception.dart';
 export 'src/shared/llama_exception.dart';
 
+import 'src/shared/llama_logprob.dart';
+export 'src/shared/llama_logprob.dart';
+
 part 'src/native/llama.dart';
 part 'src/native/llama_worker.dart';
 part 'src/native/llama_message_extension.dart';
+part 'src/native/llama_vector_store.dart';
@@ -1,5 +1,7 @@
 library;
 
+import 'dart:typed_data';
+
 import 'src/shared/llama_message.dart';
 export 'src/shared/llama_message.dart';
 
@@ -9,4 +11,8 @@ export 'src/shared/llama_controller.dart';
 import 'src/shared/llama_exception.dart';
 export 'src/shared/llama_exception.dart';
 
+import 'src/shared/llama_logprob.dart';
+export 'src/shared/llama_logprob.dart';
+
 part 'src/web/llama.dart';
+part 'src/web/llama_vector_store.dart';
@@ -54,6 +54,166 @@ class llama {
   late final _llama_prompt = _llama_promptPtr.asFunction<
       int Function(ffi.Pointer<ffi.Char>, ffi.Pointer<dart_output>)>();
 
+  int llama_submit(
+    ffi.Pointer<ffi.Char> messages,
+    ffi.Pointer<dart_response> response,
+  ) {
+    return _llama_submit(messages, response);
+  }
+
+  late final _llama_submitPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(ffi.Pointer<ffi.Char>,
+              ffi.Pointer<dart_response>)>>('llama_submit');
+  late final _llama_submit = _llama_submitPtr.asFunction<
+      int Function(ffi.Pointer<ffi.Char>, ffi.Pointer<dart_response>)>();
+
+  int llama_submit_history(ffi.Pointer<dart_response> response) {
+    return _llama_submit_history(response);
+  }
+
+  late final _llama_submit_historyPtr = _lookup<
+          ffi.NativeFunction<ffi.Int Function(ffi.Pointer<dart_response>)>>(
+      'llama_submit_history');
+  late final _llama_submit_history = _llama_submit_historyPtr
+      .asFunction<int Function(ffi.Pointer<dart_response>)>();
+
+  int llama_append(
+    ffi.Pointer<ffi.Char> role,
+    ffi.Pointer<ffi.Char> content,
+  ) {
+    return _llama_append(role, content);
+  }
+
+  late final _llama_appendPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(
+              ffi.Pointer<ffi.Char>, ffi.Pointer<ffi.Char>)>>('llama_append');
+  late final _llama_append = _llama_appendPtr.asFunction<
+      int Function(ffi.Pointer<ffi.Char>, ffi.Pointer<ffi.Char>)>();
+
+  int llama_truncate(int n_messages) {
+    return _llama_truncate(n_messages);
+  }
+
+  late final _llama_truncatePtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function(ffi.Int)>>(
+    'llama_truncate',
+  );
+  late final _llama_truncate =
+      _llama_truncatePtr.asFunction<int Function(int)>();
+
+  void llama_request_cancel(int request) {
+    return _llama_request_cancel(request);
+  }
+
+  late final _llama_request_cancelPtr =
+      _lookup<ffi.NativeFunction<ffi.Void Function(ffi.Int)>>(
+    'llama_request_cancel',
+  );
+  late final _llama_request_cancel =
+      _llama_request_cancelPtr.asFunction<void Function(int)>();
+
+  void llama_free_string(ffi.Pointer<ffi.Char> string) {
+    return _llama_free_string(string);
+  }
+
+  late final _llama_free_stringPtr =
+      _lookup<ffi.NativeFunction<ffi.Void Function(ffi.Pointer<ffi.Char>)>>(
+    'llama_free_string',
+  );
+  late final _llama_free_string = _llama_free_stringPtr
+      .asFunction<void Function(ffi.Pointer<ffi.Char>)>();
+
+  int llama_start(ffi.Pointer<ffi.Char> messages) {
+    return _llama_start(messages);
+  }
+
+  late final _llama_startPtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function(ffi.Pointer<ffi.Char>)>>(
+    'llama_start',
+  );
+  late final _llama_start =
+      _llama_startPtr.asFunction<int Function(ffi.Pointer<ffi.Char>)>();
+
+  int llama_poll_output(
+    ffi.Pointer<ffi.Char> buffer,
+    int size,
+  ) {
+    return _llama_poll_output(buffer, size);
+  }
+
+  late final _llama_poll_outputPtr = _lookup<
+          ffi.NativeFunction<ffi.Int Function(ffi.Pointer<ffi.Char>, ffi.Int)>>(
+      'llama_poll_output');
+  late final _llama_poll_output = _llama_poll_outputPtr
+      .asFunction<int Function(ffi.Pointer<ffi.Char>, int)>();
+
+  void llama_set_progress(
+    ffi.Pointer<dart_progress> progress,
+  ) {
+    return _llama_set_progress(progress);
+  }
+
+  late final _llama_set_progressPtr = _lookup<
+          ffi.NativeFunction<ffi.Void Function(ffi.Pointer<dart_progress>)>>(
+      'llama_set_progress');
+  late final _llama_set_progress = _llama_set_progressPtr
+      .asFunction<void Function(ffi.Pointer<dart_progress>)>();
+
+  int llama_set_logprobs(
+    int n_top,
+    ffi.Pointer<dart_logprobs> logprobs,
+  ) {
+    return _llama_set_logprobs(n_top, logprobs);
+  }
+
+  late final _llama_set_logprobsPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(
+              ffi.Int, ffi.Pointer<dart_logprobs>)>>('llama_set_logprobs');
+  late final _llama_set_logprobs = _llama_set_logprobsPtr
+      .asFunction<int Function(int, ffi.Pointer<dart_logprobs>)>();
+
+  int llama_set_sampler(
+    ffi.Pointer<ffi.Char> params,
+  ) {
+    return _llama_set_sampler(params);
+  }
+
+  late final _llama_set_samplerPtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function(ffi.Pointer<ffi.Char>)>>(
+    'llama_set_sampler',
+  );
+  late final _llama_set_sampler =
+      _llama_set_samplerPtr.asFunction<int Function(ffi.Pointer<ffi.Char>)>();
+
+  int llama_token_piece(
+    int token,
+    ffi.Pointer<ffi.Char> buffer,
+    int size,
+  ) {
+    return _llama_token_piece(token, buffer, size);
+  }
+
+  late final _llama_token_piecePtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(
+              ffi.Int, ffi.Pointer<ffi.Char>, ffi.Int)>>('llama_token_piece');
+  late final _llama_token_piece = _llama_token_piecePtr
+      .asFunction<int Function(int, ffi.Pointer<ffi.Char>, int)>();
+
+  ffi.Pointer<ffi.Char> llama_stats() {
+    return _llama_stats();
+  }
+
+  late final _llama_statsPtr =
+      _lookup<ffi.NativeFunction<ffi.Pointer<ffi.Char> Function()>>(
+    'llama_stats',
+  );
+  late final _llama_stats =
+      _llama_statsPtr.asFunction<ffi.Pointer<ffi.Char> Function()>();
+
   void llama_llm_stop() {
     return _llama_llm_stop();
   }
@@ -69,7 +229,442 @@ class llama {
   late final _llama_llm_freePtr =
       _lookup<ffi.NativeFunction<ffi.Void Function()>>('llama_llm_free');
   late final _llama_llm_free = _llama_llm_freePtr.asFunction<void Function()>();
+
+  int llama_session_create() {
+    return _llama_session_create();
+  }
+
+  late final _llama_session_createPtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function()>>('llama_session_create');
+  late final _llama_session_create =
+      _llama_session_createPtr.asFunction<int Function()>();
+
+  int llama_session_prompt(
+    int session,
+    ffi.Pointer<ffi.Char> messages,
+    ffi.Pointer<dart_output> output,
+  ) {
+    return _llama_session_prompt(session, messages, output);
+  }
+
+  late final _llama_session_promptPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(ffi.Int, ffi.Pointer<ffi.Char>,
+              ffi.Pointer<dart_output>)>>('llama_session_prompt');
+  late final _llama_session_prompt = _llama_session_promptPtr.asFunction<
+      int Function(int, ffi.Pointer<ffi.Char>, ffi.Pointer<dart_output>)>();
+
+  int llama_session_submit(
+    int session,
+    ffi.Pointer<ffi.Char> messages,
+    ffi.Pointer<dart_response> response,
+  ) {
+    return _llama_session_submit(session, messages, response);
+  }
+
+  late final _llama_session_submitPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(ffi.Int, ffi.Pointer<ffi.Char>,
+              ffi.Pointer<dart_response>)>>('llama_session_submit');
+  late final _llama_session_submit = _llama_session_submitPtr.asFunction<
+      int Function(int, ffi.Pointer<ffi.Char>, ffi.Pointer<dart_response>)>();
+
+  int llama_session_submit_history(
+    int session,
+    ffi.Pointer<dart_response> response,
+  ) {
+    return _llama_session_submit_history(session, response);
+  }
+
+  late final _llama_session_submit_historyPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(ffi.Int,
+              ffi.Pointer<dart_response>)>>('llama_session_submit_history');
+  late final _llama_session_submit_history = _llama_session_submit_historyPtr
+      .asFunction<int Function(int, ffi.Pointer<dart_response>)>();
+
+  int llama_session_append(
+    int session,
+    ffi.Pointer<ffi.Char> role,
+    ffi.Pointer<ffi.Char> content,
+  ) {
+    return _llama_session_append(session, role, content);
+  }
+
+  late final _llama_session_appendPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(ffi.Int, ffi.Pointer<ffi.Char>,
+              ffi.Pointer<ffi.Char>)>>('llama_session_append');
+  late final _llama_session_append = _llama_session_appendPtr.asFunction<
+      int Function(int, ffi.Pointer<ffi.Char>, ffi.Pointer<ffi.Char>)>();
+
+  int llama_session_truncate(
+    int session,
+    int n_messages,
+  ) {
+    return _llama_session_truncate(session, n_messages);
+  }
+
+  late final _llama_session_truncatePtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function(ffi.Int, ffi.Int)>>(
+    'llama_session_truncate',
+  );
+  late final _llama_session_truncate =
+      _llama_session_truncatePtr.asFunction<int Function(int, int)>();
+
+  int llama_session_start(
+    int session,
+    ffi.Pointer<ffi.Char> messages,
+  ) {
+    return _llama_session_start(session, messages);
+  }
+
+  late final _llama_session_startPtr = _lookup<
+          ffi.NativeFunction<ffi.Int Function(ffi.Int, ffi.Pointer<ffi.Char>)>>(
+      'llama_session_start');
+  late final _llama_session_start = _llama_session_startPtr
+      .asFunction<int Function(int, ffi.Pointer<ffi.Char>)>();
+
+  int llama_session_poll_output(
+    int session,
+    ffi.Pointer<ffi.Char> buffer,
+    int size,
+  ) {
+    return _llama_session_poll_output(session, buffer, size);
+  }
+
+  late final _llama_session_poll_outputPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(
+              ffi.Int, ffi.Pointer<ffi.Char>, ffi.Int)>>('llama_session_poll_output');
+  late final _llama_session_poll_output = _llama_session_poll_outputPtr
+      .asFunction<int Function(int, ffi.Pointer<ffi.Char>, int)>();
+
+  void llama_session_set_progress(
+    int session,
+    ffi.Pointer<dart_progress> progress,
+  ) {
+    return _llama_session_set_progress(session, progress);
+  }
+
+  late final _llama_session_set_progressPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Void Function(
+              ffi.Int, ffi.Pointer<dart_progress>)>>('llama_session_set_progress');
+  late final _llama_session_set_progress = _llama_session_set_progressPtr
+      .asFunction<void Function(int, ffi.Pointer<dart_progress>)>();
+
+  int llama_session_set_logprobs(
+    int session,
+    int n_top,
+    ffi.Pointer<dart_logprobs> logprobs,
+  ) {
+    return _llama_session_set_logprobs(session, n_top, logprobs);
+  }
+
+  late final _llama_session_set_logprobsPtr = _lookup<
+          ffi.NativeFunction<
+              ffi.Int Function(ffi.Int, ffi.Int, ffi.Pointer<dart_logprobs>)>>(
+      'llama_session_set_logprobs');
+  late final _llama_session_set_logprobs = _llama_session_set_logprobsPtr
+      .asFunction<int Function(int, int, ffi.Pointer<dart_logprobs>)>();
+
+  int llama_session_set_sampler(
+    int session,
+    ffi.Pointer<ffi.Char> params,
+  ) {
+    return _llama_session_set_sampler(session, params);
+  }
+
+  late final _llama_session_set_samplerPtr = _lookup<
+          ffi.NativeFunction<ffi.Int Function(ffi.Int, ffi.Pointer<ffi.Char>)>>(
+      'llama_session_set_sampler');
+  late final _llama_session_set_sampler = _llama_session_set_samplerPtr
+      .asFunction<int Function(int, ffi.Pointer<ffi.Char>)>();
+
+  ffi.Pointer<ffi.Char> llama_session_stats(int session) {
+    return _llama_session_stats(session);
+  }
+
+  late final _llama_session_statsPtr =
+      _lookup<ffi.NativeFunction<ffi.Pointer<ffi.Char> Function(ffi.Int)>>(
+    'llama_session_stats',
+  );
+  late final _llama_session_stats = _llama_session_statsPtr
+      .asFunction<ffi.Pointer<ffi.Char> Function(int)>();
+
+  void llama_session_stop(int session) {
+    return _llama_session_stop(session);
+  }
+
+  late final _llama_session_stopPtr =
+      _lookup<ffi.NativeFunction<ffi.Void Function(ffi.Int)>>(
+    'llama_session_stop',
+  );
+  late final _llama_session_stop =
+      _llama_session_stopPtr.asFunction<void Function(int)>();
+
+  int llama_session_free(int session) {
+    return _llama_session_free(session);
+  }
+
+  late final _llama_session_freePtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function(ffi.Int)>>(
+    'llama_session_free',
+  );
+  late final _llama_session_free =
+      _llama_session_freePtr.asFunction<int Function(int)>();
+
+  int llama_session_suspend(
+    int session,
+    ffi.Pointer<ffi.Char> path,
+  ) {
+    return _llama_session_suspend(session, path);
+  }
+
+  late final _llama_session_suspendPtr = _lookup<
+          ffi.NativeFunction<ffi.Int Function(ffi.Int, ffi.Pointer<ffi.Char>)>>(
+      'llama_session_suspend');
+  late final _llama_session_suspend = _llama_session_suspendPtr
+      .asFunction<int Function(int, ffi.Pointer<ffi.Char>)>();
+
+  int llama_session_resume(
+    int session,
+    ffi.Pointer<ffi.Char> path,
+  ) {
+    return _llama_session_resume(session, path);
+  }
+
+  late final _llama_session_resumePtr = _lookup<
+          ffi.NativeFunction<ffi.Int Function(ffi.Int, ffi.Pointer<ffi.Char>)>>(
+      'llama_session_resume');
+  late final _llama_session_resume = _llama_session_resumePtr
+      .asFunction<int Function(int, ffi.Pointer<ffi.Char>)>();
+
+  int llama_embed(
+    ffi.Pointer<ffi.Pointer<ffi.Char>> texts,
+    int n_texts,
+    ffi.Pointer<ffi.Float> embeddings,
+    int normalize,
+  ) {
+    return _llama_embed(texts, n_texts, embeddings, normalize);
+  }
+
+  late final _llama_embedPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(ffi.Pointer<ffi.Pointer<ffi.Char>>, ffi.Int,
+              ffi.Pointer<ffi.Float>, ffi.Int)>>('llama_embed');
+  late final _llama_embed = _llama_embedPtr.asFunction<
+      int Function(ffi.Pointer<ffi.Pointer<ffi.Char>>, int,
+          ffi.Pointer<ffi.Float>, int)>();
+
+  int llama_rerank(
+    ffi.Pointer<ffi.Char> query,
+    ffi.Pointer<ffi.Pointer<ffi.Char>> passages,
+    int n_passages,
+    ffi.Pointer<ffi.Float> scores,
+  ) {
+    return _llama_rerank(query, passages, n_passages, scores);
+  }
+
+  late final _llama_rerankPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(ffi.Pointer<ffi.Char>, ffi.Pointer<ffi.Pointer<ffi.Char>>,
+              ffi.Int, ffi.Pointer<ffi.Float>)>>('llama_rerank');
+  late final _llama_rerank = _llama_rerankPtr.asFunction<
+      int Function(ffi.Pointer<ffi.Char>, ffi.Pointer<ffi.Pointer<ffi.Char>>, int,
+          ffi.Pointer<ffi.Float>)>();
+
+  int llama_loglikelihood(
+    ffi.Pointer<ffi.Char> prompt,
+    ffi.Pointer<ffi.Pointer<ffi.Char>> candidates,
+    int n_candidates,
+    ffi.Pointer<ffi.Float> logprobs,
+  ) {
+    return _llama_loglikelihood(prompt, candidates, n_candidates, logprobs);
+  }
+
+  late final _llama_loglikelihoodPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(ffi.Pointer<ffi.Char>, ffi.Pointer<ffi.Pointer<ffi.Char>>,
+              ffi.Int, ffi.Pointer<ffi.Float>)>>('llama_loglikelihood');
+  late final _llama_loglikelihood = _llama_loglikelihoodPtr.asFunction<
+      int Function(ffi.Pointer<ffi.Char>, ffi.Pointer<ffi.Pointer<ffi.Char>>, int,
+          ffi.Pointer<ffi.Float>)>();
+
+  int llama_prompt_n(
+    ffi.Pointer<ffi.Char> messages,
+    int n,
+    int n_predict,
+    ffi.Pointer<ffi.Pointer<ffi.Char>> replies,
+  ) {
+    return _llama_prompt_n(messages, n, n_predict, replies);
+  }
+
+  late final _llama_prompt_nPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(ffi.Pointer<ffi.Char>, ffi.Int, ffi.Int,
+              ffi.Pointer<ffi.Pointer<ffi.Char>>)>>('llama_prompt_n');
+  late final _llama_prompt_n = _llama_prompt_nPtr.asFunction<
+      int Function(
+          ffi.Pointer<ffi.Char>, int, int, ffi.Pointer<ffi.Pointer<ffi.Char>>)>();
+
+  int llama_embedding_size() {
+    return _llama_embedding_size();
+  }
+
+  late final _llama_embedding_sizePtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function()>>('llama_embedding_size');
+  late final _llama_embedding_size =
+      _llama_embedding_sizePtr.asFunction<int Function()>();
+
+  int llama_vector_store_create(
+    int dim,
+    int quantize,
+  ) {
+    return _llama_vector_store_create(dim, quantize);
+  }
+
+  late final _llama_vector_store_createPtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function(ffi.Int, ffi.Int)>>(
+          'llama_vector_store_create');
+  late final _llama_vector_store_create =
+      _llama_vector_store_createPtr.asFunction<int Function(int, int)>();
+
+  int llama_vector_store_open(
+    ffi.Pointer<ffi.Char> path,
+  ) {
+    return _llama_vector_store_open(path);
+  }
+
+  late final _llama_vector_store_openPtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function(ffi.Pointer<ffi.Char>)>>(
+          'llama_vector_store_open');
+  late final _llama_vector_store_open = _llama_vector_store_openPtr
+      .asFunction<int Function(ffi.Pointer<ffi.Char>)>();
+
+  int llama_vector_store_save(
+    int store,
+    ffi.Pointer<ffi.Char> path,
+  ) {
+    return _llama_vector_store_save(store, path);
+  }
+
+  late final _llama_vector_store_savePtr = _lookup<
+          ffi.NativeFunction<ffi.Int Function(ffi.Int, ffi.Pointer<ffi.Char>)>>(
+      'llama_vector_store_save');
+  late final _llama_vector_store_save = _llama_vector_store_savePtr
+      .asFunction<int Function(int, ffi.Pointer<ffi.Char>)>();
+
+  int llama_vector_store_dim(
+    int store,
+  ) {
+    return _llama_vector_store_dim(store);
+  }
+
+  late final _llama_vector_store_dimPtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function(ffi.Int)>>(
+          'llama_vector_store_dim');
+  late final _llama_vector_store_dim =
+      _llama_vector_store_dimPtr.asFunction<int Function(int)>();
+
+  int llama_vector_store_size(
+    int store,
+  ) {
+    return _llama_vector_store_size(store);
+  }
+
+  late final _llama_vector_store_sizePtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function(ffi.Int)>>(
+          'llama_vector_store_size');
+  late final _llama_vector_store_size =
+      _llama_vector_store_sizePtr.asFunction<int Function(int)>();
+
+  int llama_vector_store_add(
+    int store,
+    ffi.Pointer<ffi.Float> vectors,
+    ffi.Pointer<ffi.Int64> ids,
+    int n,
+  ) {
+    return _llama_vector_store_add(store, vectors, ids, n);
+  }
+
+  late final _llama_vector_store_addPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(ffi.Int, ffi.Pointer<ffi.Float>,
+              ffi.Pointer<ffi.Int64>, ffi.Int)>>('llama_vector_store_add');
+  late final _llama_vector_store_add = _llama_vector_store_addPtr.asFunction<
+      int Function(int, ffi.Pointer<ffi.Float>, ffi.Pointer<ffi.Int64>, int)>();
+
+  int llama_vector_store_build_index(
+    int store,
+    int n_lists,
+  ) {
+    return _llama_vector_store_build_index(store, n_lists);
+  }
+
+  late final _llama_vector_store_build_indexPtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function(ffi.Int, ffi.Int)>>(
+          'llama_vector_store_build_index');
+  late final _llama_vector_store_build_index = _llama_vector_store_build_indexPtr
+      .asFunction<int Function(int, int)>();
+
+  int llama_vector_store_search(
+    int store,
+    ffi.Pointer<ffi.Float> query,
+    int k,
+    int n_probe,
+    ffi.Pointer<ffi.Int64> ids,
+    ffi.Pointer<ffi.Float> scores,
+  ) {
+    return _llama_vector_store_search(store, query, k, n_probe, ids, scores);
+  }
+
+  late final _llama_vector_store_searchPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(
+              ffi.Int,
+              ffi.Pointer<ffi.Float>,
+              ffi.Int,
+              ffi.Int,
+              ffi.Pointer<ffi.Int64>,
+              ffi.Pointer<ffi.Float>)>>('llama_vector_store_search');
+  late final _llama_vector_store_search =
+      _llama_vector_store_searchPtr.asFunction<
+          int Function(int, ffi.Pointer<ffi.Float>, int, int,
+              ffi.Pointer<ffi.Int64>, ffi.Pointer<ffi.Float>)>();
+
+  int llama_vector_store_free(
+    int store,
+  ) {
+    return _llama_vector_store_free(store);
+  }
+
+  late final _llama_vector_store_freePtr =
+      _lookup<ffi.NativeFunction<ffi.Int Function(ffi.Int)>>(
+          'llama_vector_store_free');
+  late final _llama_vector_store_free =
+      _llama_vector_store_freePtr.asFunction<int Function(int)>();
 }
 
 typedef dart_output
     = ffi.NativeFunction<ffi.Void Function(ffi.Pointer<ffi.Char> buffer)>;
+
+typedef dart_progress = ffi.NativeFunction<
+    ffi.Void Function(ffi.Int n_processed, ffi.Int n_total)>;
+
+typedef dart_response = ffi.NativeFunction<dart_responseFunction>;
+typedef dart_responseFunction = ffi.Void Function(
+    ffi.Int request, ffi.Pointer<ffi.Char> piece, ffi.Int status);
+
+final class llama_token_logprob extends ffi.Struct {
+  @ffi.Int32()
+  external int token;
+
+  @ffi.Float()
+  external double logprob;
+}
+
+typedef dart_logprobs = ffi.NativeFunction<dart_logprobsFunction>;
+typedef dart_logprobsFunction = ffi.Void Function(ffi.Int session,
+    ffi.Pointer<llama_token_logprob> records, ffi.Int n_records, ffi.Int n_top);
@@ -24,11 +24,20 @@ class Llama {
   SendPort? _sendPort;
   ReceivePort? _receivePort;
 
+  final StreamController<List<LlamaLogprob>> _logprobsController =
+      StreamController<List<LlamaLogprob>>.broadcast();
+
+  /// Pending [promptN], [embed], [rerank] and [loglikelihood] calls, the worker answers
+  /// them in order
+  final List<Completer<Object>> _requests = [];
+
   LlamaController _controller;
 
   /// Gets the current LlamaController instance.
   ///
   /// The [LlamaController] instance contains the parameters used by the llama.
+  /// Its sampling parameters apply from the next [prompt] on, the others once
+  /// the model is reloaded.
   ///
   /// Returns the current [LlamaController] instance.
   LlamaController get controller => _controller;
@@ -63,6 +72,14 @@ class Llama {
         _initialized.complete();
       } else if (data is String) {
         _responseController.add(data);
+      } else if (data is List<LlamaLogprob>) {
+        _logprobsController.add(data);
+      } else if (data is List<Float32List> ||
+          data is Float32List ||
+          data is List<String>) {
+        _requests.removeAt(0).complete(data);
+      } else if (data is LlamaException) {
+        _requests.removeAt(0).completeError(data);
       } else if (data == null) {
         _responseController.close();
       }
@@ -87,13 +104,125 @@ class Llama {
 
     _responseController = StreamController<String>();
 
-    _sendPort!.send(messages.toRecords());
+    // sent with every prompt, so changed sampling parameters apply without a reload
+    _sendPort!.send((
+      messages: messages.toRecords(),
+      sampler: _controller.toSamplerJson(),
+    ));
 
     await for (final response in _responseController.stream) {
       yield response;
     }
   }
 
+  /// Generates [n] alternative replies to the same chat messages.
+  ///
+  /// The prompt is decoded once and the replies are generated together, one
+  /// token of each per batch, so asking for a few suggestions costs little more
+  /// than a single reply. Each reply samples with a seed of its own, derived
+  /// from the seed in the [LlamaController]. With greedy sampling every reply
+  /// is the same. The messages do not become part of the chat history.
+  ///
+  /// - Parameter messages: The chat to reply to.
+  /// - Parameter n: How many replies to generate.
+  /// - Parameter nPredict: The most tokens of a reply, 0 leaves them to the context.
+  /// - Returns: The replies, complete.
+  Future<List<String>> promptN(List<LlamaMessage> messages, int n,
+      {int nPredict = 0}) async {
+    if (!_initialized.isCompleted) {
+      _listener();
+      await _initialized.future;
+    }
+
+    final completer = Completer<Object>();
+    _requests.add(completer);
+
+    _sendPort!.send(
+        (messages: messages.toRecords(), n: n, nPredict: nPredict));
+
+    return await completer.future as List<String>;
+  }
+
+  /// The logprobs of the generated tokens, while [LlamaController.topLogprobs]
+  /// is set.
+  ///
+  /// Each event holds one [LlamaLogprob] per token of the next text the
+  /// [prompt] stream yields, and arrives before that text. Pieces buffered by
+  /// `stream_flush_tokens` arrive together.
+  Stream<List<LlamaLogprob>> get logprobs => _logprobsController.stream;
+
+  /// Computes an embedding vector for each of the provided texts.
+  ///
+  /// The texts are encoded together, packed into as few batches as the
+  /// context's sequences allow. Requires a model loaded with `embeddings`
+  /// enabled in the [LlamaController].
+  ///
+  /// - Parameter texts: The texts to embed.
+  /// - Parameter normalize: Whether to scale the vectors to unit length.
+  /// - Returns: One vector per text, in the same order.
+  Future<List<Float32List>> embed(List<String> texts,
+      {bool normalize = true}) async {
+    if (!_initialized.isCompleted) {
+      _listener();
+      await _initialized.future;
+    }
+
+    final completer = Completer<Object>();
+    _requests.add(completer);
+
+    _sendPort!.send((texts: texts, normalize: normalize));
+
+    return await completer.future as List<Float32List>;
+  }
+
+  /// Scores how relevant each passage is to the query.
+  ///
+  /// The (query, passage) pairs are scored together, packed into as few
+  /// batches as the context's sequences allow. Requires a reranking model
+  /// loaded with [PoolingType.rank] in the [LlamaController].
+  ///
+  /// - Parameter query: The query the passages are scored against.
+  /// - Parameter passages: The candidate passages.
+  /// - Returns: One score per passage, in the same order, higher is more relevant.
+  Future<Float32List> rerank(String query, List<String> passages) async {
+    if (!_initialized.isCompleted) {
+      _listener();
+      await _initialized.future;
+    }
+
+    final completer = Completer<Object>();
+    _requests.add(completer);
+
+    _sendPort!.send((query: query, passages: passages));
+
+    return await completer.future as Float32List;
+  }
+
+  /// Scores how likely each candidate is to continue the prompt.
+  ///
+  /// The prompt is decoded once and shared by all candidates, which are then
+  /// scored together in as few batches as the context's sequences allow. This
+  /// classifies text into a fixed set of labels in one pass, without
+  /// generating. The prompt is used as is, no chat template is applied.
+  ///
+  /// - Parameter prompt: The text the candidates continue.
+  /// - Parameter candidates: The possible continuations.
+  /// - Returns: The summed log-probability of each candidate, in the same order.
+  Future<Float32List> loglikelihood(
+      String prompt, List<String> candidates) async {
+    if (!_initialized.isCompleted) {
+      _listener();
+      await _initialized.future;
+    }
+
+    final completer = Completer<Object>();
+    _requests.add(completer);
+
+    _sendPort!.send((prompt: prompt, candidates: candidates));
+
+    return await completer.future as Float32List;
+  }
+
   /// Stops the current operation or process.
   ///
   /// This method should be called to terminate any ongoing tasks or
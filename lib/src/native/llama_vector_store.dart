@@ -0,0 +1,143 @@
+part of 'package:llama_sdk/llama_sdk.dart';
+
+/// A store of embedding vectors searched natively, without copying them to Dart.
+///
+/// Vectors are kept in one contiguous native block, as floats or, when
+/// [quantize] is set, as int8 rows at a quarter of the memory. Results are
+/// scored by dot product, so vectors from [Llama.embed] with `normalize` set
+/// are ranked by cosine similarity.
+///
+/// For large stores, [buildIndex] clusters the vectors so that [search] only
+/// scans the lists closest to the query. Vectors added afterwards are always
+/// scanned, until the index is built again.
+///
+/// The store lives in native memory, call [dispose] when done with it.
+class LlamaVectorStore {
+  final int _id;
+
+  /// Creates an empty store of [dimension] wide vectors.
+  LlamaVectorStore(int dimension, {bool quantize = false})
+      : _id = lib.llama_vector_store_create(dimension, quantize ? 1 : 0) {
+    if (_id < 0) {
+      throw LlamaException('Failed to create the vector store');
+    }
+  }
+
+  LlamaVectorStore._(this._id);
+
+  /// Opens a store written by [save]. The file is memory-mapped where the
+  /// platform allows it, so opening does not read it whole.
+  factory LlamaVectorStore.open(String path) {
+    final nativePath = path.toNativeUtf8();
+    final id = lib.llama_vector_store_open(nativePath.cast<ffi.Char>());
+    malloc.free(nativePath);
+
+    if (id < 0) {
+      throw LlamaException('Failed to open the vector store $path');
+    }
+
+    return LlamaVectorStore._(id);
+  }
+
+  /// The width of the stored vectors.
+  int get dimension => lib.llama_vector_store_dim(_id);
+
+  /// The number of stored vectors.
+  int get length => lib.llama_vector_store_size(_id);
+
+  /// Adds [vectors], each labelled with the id at the same position of [ids].
+  void add(List<Float32List> vectors, List<int> ids) {
+    if (vectors.length != ids.length) {
+      throw ArgumentError('Every vector needs an id');
+    }
+
+    final dim = dimension;
+    final nativeVectors = calloc<ffi.Float>(vectors.length * dim);
+    final nativeIds = calloc<ffi.Int64>(ids.length);
+
+    try {
+      final values = nativeVectors.asTypedList(vectors.length * dim);
+      for (var i = 0; i < vectors.length; i++) {
+        if (vectors[i].length != dim) {
+          throw ArgumentError('Vector $i is not $dim wide');
+        }
+
+        values.setAll(i * dim, vectors[i]);
+        nativeIds[i] = ids[i];
+      }
+
+      final result = lib.llama_vector_store_add(
+        _id,
+        nativeVectors,
+        nativeIds,
+        vectors.length,
+      );
+
+      if (result != 0) {
+        throw LlamaException('Failed to add the vectors');
+      }
+    } finally {
+      calloc.free(nativeVectors);
+      calloc.free(nativeIds);
+    }
+  }
+
+  /// Clusters the vectors into [lists] lists, around the square root of
+  /// [length] is a good start. 0 drops the index.
+  void buildIndex(int lists) {
+    if (lib.llama_vector_store_build_index(_id, lists) != 0) {
+      throw LlamaException('Failed to build the index');
+    }
+  }
+
+  /// Returns the ids and scores of the [k] vectors closest to [query], best
+  /// first. An indexed store scans the [probes] closest lists, more probes
+  /// find more of the true neighbours at the cost of time.
+  List<(int id, double score)> search(Float32List query,
+      {int k = 10, int probes = 8}) {
+    if (query.length != dimension) {
+      throw ArgumentError('The query is not $dimension wide');
+    }
+
+    final nativeQuery = calloc<ffi.Float>(query.length);
+    final nativeIds = calloc<ffi.Int64>(k);
+    final nativeScores = calloc<ffi.Float>(k);
+
+    try {
+      nativeQuery.asTypedList(query.length).setAll(0, query);
+
+      final n = lib.llama_vector_store_search(
+        _id,
+        nativeQuery,
+        k,
+        probes,
+        nativeIds,
+        nativeScores,
+      );
+
+      if (n < 0) {
+        throw LlamaException('Failed to search the vector store');
+      }
+
+      return [for (var i = 0; i < n; i++) (nativeIds[i], nativeScores[i])];
+    } finally {
+      calloc.free(nativeQuery);
+      calloc.free(nativeIds);
+      calloc.free(nativeScores);
+    }
+  }
+
+  /// Writes the store, its index included, to [path].
+  void save(String path) {
+    final nativePath = path.toNativeUtf8();
+    final result = lib.llama_vector_store_save(_id, nativePath.cast<ffi.Char>());
+    malloc.free(nativePath);
+
+    if (result != 0) {
+      throw LlamaException('Failed to save the vector store to $path');
+    }
+  }
+
+  /// Frees the native memory of the store.
+  void dispose() => lib.llama_vector_store_free(_id);
+}
@@ -23,7 +23,21 @@ class _LlamaWorker {
   _LlamaWorker({required SendPort sendPort, required this.controller}) {
     _sendPort = sendPort;
     sendPort.send(receivePort.sendPort);
-    receivePort.listen(handlePrompt);
+    receivePort.listen((data) {
+      if (data is ({List<String> texts, bool normalize})) {
+        handleEmbed(data);
+      } else if (data is ({String query, List<String> passages})) {
+        handleRerank(data);
+      } else if (data is ({String prompt, List<String> candidates})) {
+        handleLoglikelihood(data);
+      } else if (data
+          is ({List<_LlamaMessageRecord> messages, int n, int nPredict})) {
+        handlePromptN(data);
+      } else if (data
+          is ({List<_LlamaMessageRecord> messages, String sampler})) {
+        handlePrompt(data);
+      }
+    });
     _init();
   }
 
@@ -32,16 +46,230 @@ class _LlamaWorker {
         controller: LlamaController.fromJson(record.$2),
       );
 
-  void handlePrompt(dynamic data) async {
+  void handlePrompt(
+      ({List<_LlamaMessageRecord> messages, String sampler}) data) async {
     try {
-      final messages = _LlamaMessagesExtension.fromRecords(
-        data as List<_LlamaMessageRecord>,
+      final (messages: records, :sampler) = data;
+
+      final nativeSampler = sampler.toNativeUtf8();
+      final samplerResult = lib.llama_set_sampler(nativeSampler.cast<ffi.Char>());
+      malloc.free(nativeSampler);
+
+      if (samplerResult != 0) {
+        throw LlamaException('Failed to set the sampler');
+      }
+
+      // only the messages the native side does not hold yet cross over
+      var shared = 0;
+      while (shared < _history.length &&
+          shared < records.length &&
+          _history[shared] == records[shared]) {
+        shared++;
+      }
+
+      if (shared < _history.length) {
+        if (lib.llama_truncate(shared) != 0) {
+          throw LlamaException('Failed to truncate the chat history');
+        }
+
+        _history.removeRange(shared, _history.length);
+      }
+
+      for (final record in records.skip(shared)) {
+        final role = record.$1.toNativeUtf8();
+        final content = record.$2.toNativeUtf8();
+
+        final result = lib.llama_append(
+          role.cast<ffi.Char>(),
+          content.cast<ffi.Char>(),
+        );
+
+        malloc.free(role);
+        malloc.free(content);
+
+        if (result != 0) {
+          throw LlamaException('Failed to append a message');
+        }
+
+        _history.add(record);
+      }
+
+      _reply.clear();
+
+      final request = lib.llama_submit_history(_response.nativeFunction);
+      if (request < 0) {
+        _sendPort!.send(null);
+      }
+    } catch (e) {
+      _sendPort!.send(null);
+    }
+  }
+
+  void handleEmbed(({List<String> texts, bool normalize}) data) {
+    final (:texts, :normalize) = data;
+
+    final size = lib.llama_embedding_size();
+    final natives = calloc<ffi.Pointer<ffi.Char>>(texts.length);
+    final embeddings = calloc<ffi.Float>(texts.length * size);
+
+    try {
+      for (var i = 0; i < texts.length; i++) {
+        natives[i] = texts[i].toNativeUtf8().cast<ffi.Char>();
+      }
+
+      final result = lib.llama_embed(
+        natives,
+        texts.length,
+        embeddings,
+        normalize ? 1 : 0,
+      );
+
+      if (result != 0) {
+        throw LlamaException('Failed to embed the texts');
+      }
+
+      // sublist copies, the rows outlive the native buffer
+      final values = embeddings.asTypedList(texts.length * size);
+      final rows = [
+        for (var i = 0; i < texts.length; i++)
+          values.sublist(i * size, (i + 1) * size),
+      ];
+
+      _sendPort!.send(rows);
+    } catch (e) {
+      _sendPort!.send(
+        e is LlamaException ? e : LlamaException('Failed to embed the texts'),
+      );
+    } finally {
+      for (var i = 0; i < texts.length; i++) {
+        if (natives[i] != ffi.nullptr) {
+          malloc.free(natives[i]);
+        }
+      }
+
+      calloc.free(natives);
+      calloc.free(embeddings);
+    }
+  }
+
+  void handleRerank(({String query, List<String> passages}) data) {
+    final (:query, :passages) = data;
+
+    final nativeQuery = query.toNativeUtf8();
+    final natives = calloc<ffi.Pointer<ffi.Char>>(passages.length);
+    final scores = calloc<ffi.Float>(passages.length);
+
+    try {
+      for (var i = 0; i < passages.length; i++) {
+        natives[i] = passages[i].toNativeUtf8().cast<ffi.Char>();
+      }
+
+      final result = lib.llama_rerank(
+        nativeQuery.cast<ffi.Char>(),
+        natives,
+        passages.length,
+        scores,
+      );
+
+      if (result != 0) {
+        throw LlamaException('Failed to rerank the passages');
+      }
+
+      _sendPort!.send(Float32List.fromList(scores.asTypedList(passages.length)));
+    } catch (e) {
+      _sendPort!.send(
+        e is LlamaException
+            ? e
+            : LlamaException('Failed to rerank the passages'),
       );
-      final llamaMessagesPointer = messages.toPointer();
+    } finally {
+      for (var i = 0; i < passages.length; i++) {
+        if (natives[i] != ffi.nullptr) {
+          malloc.free(natives[i]);
+        }
+      }
 
-      lib.llama_prompt(llamaMessagesPointer, ffi.Pointer.fromFunction(_output));
+      malloc.free(nativeQuery);
+      calloc.free(natives);
+      calloc.free(scores);
+    }
+  }
+
+  void handleLoglikelihood(({String prompt, List<String> candidates}) data) {
+    final (:prompt, :candidates) = data;
+
+    final nativePrompt = prompt.toNativeUtf8();
+    final natives = calloc<ffi.Pointer<ffi.Char>>(candidates.length);
+    final logprobs = calloc<ffi.Float>(candidates.length);
+
+    try {
+      for (var i = 0; i < candidates.length; i++) {
+        natives[i] = candidates[i].toNativeUtf8().cast<ffi.Char>();
+      }
+
+      final result = lib.llama_loglikelihood(
+        nativePrompt.cast<ffi.Char>(),
+        natives,
+        candidates.length,
+        logprobs,
+      );
+
+      if (result != 0) {
+        throw LlamaException('Failed to score the candidates');
+      }
+
+      _sendPort!
+          .send(Float32List.fromList(logprobs.asTypedList(candidates.length)));
     } catch (e) {
-      _output(ffi.nullptr);
+      _sendPort!.send(
+        e is LlamaException
+            ? e
+            : LlamaException('Failed to score the candidates'),
+      );
+    } finally {
+      for (var i = 0; i < candidates.length; i++) {
+        if (natives[i] != ffi.nullptr) {
+          malloc.free(natives[i]);
+        }
+      }
+
+      malloc.free(nativePrompt);
+      calloc.free(natives);
+      calloc.free(logprobs);
+    }
+  }
+
+  void handlePromptN(
+      ({List<_LlamaMessageRecord> messages, int n, int nPredict}) data) {
+    final (:messages, :n, :nPredict) = data;
+
+    final nativeMessages = _LlamaMessagesExtension.fromRecords(messages)
+        .toPointer();
+    final replies = calloc<ffi.Pointer<ffi.Char>>(n);
+
+    try {
+      final result = lib.llama_prompt_n(nativeMessages, n, nPredict, replies);
+
+      if (result != 0) {
+        throw LlamaException('Failed to generate the replies');
+      }
+
+      final texts = <String>[];
+      for (var i = 0; i < n; i++) {
+        texts.add(replies[i].cast<Utf8>().toDartString());
+        lib.llama_free_string(replies[i]);
+      }
+
+      _sendPort!.send(texts);
+    } catch (e) {
+      _sendPort!.send(
+        e is LlamaException
+            ? e
+            : LlamaException('Failed to generate the replies'),
+      );
+    } finally {
+      malloc.free(nativeMessages);
+      calloc.free(replies);
     }
   }
 
@@ -50,14 +278,79 @@ class _LlamaWorker {
     await worker.completer.future;
   }
 
-  void _init() =>
-      lib.llama_llm_init(controller.toJson().toNativeUtf8().cast<ffi.Char>());
+  void _init() {
+    final result =
+        lib.llama_llm_init(controller.toJson().toNativeUtf8().cast<ffi.Char>());
+
+    if (result == 0 && controller.topLogprobs != null) {
+      lib.llama_set_logprobs(controller.topLogprobs!, _logprobs.nativeFunction);
+    }
+  }
+
+  /// Called on this isolate for every piece the library generates, whichever
+  /// thread produced it
+  static final _response =
+      ffi.NativeCallable<dart_responseFunction>.listener(_onResponse);
+
+  /// Called on this isolate with the logprobs of the pieces about to be
+  /// handed to [_response]
+  static final _logprobs =
+      ffi.NativeCallable<dart_logprobsFunction>.listener(_onLogprobs);
+
+  /// Text of the tokens seen in logprobs so far
+  static final Map<int, String> _pieces = {};
+
+  /// Messages the native side holds, the replies it appended included
+  static final List<_LlamaMessageRecord> _history = [];
+  static final StringBuffer _reply = StringBuffer();
+
+  static void _onResponse(int request, ffi.Pointer<ffi.Char> piece, int status) {
+    if (piece == ffi.nullptr) {
+      if (status == 0) {
+        _history.add(('assistant', _reply.toString()));
+      }
 
-  static void _output(ffi.Pointer<ffi.Char> buffer) {
-    if (buffer == ffi.nullptr) {
       _sendPort!.send(null);
     } else {
-      _sendPort!.send(buffer.cast<Utf8>().toDartString());
+      final text = piece.cast<Utf8>().toDartString();
+      lib.llama_free_string(piece);
+
+      _reply.write(text);
+      _sendPort!.send(text);
     }
   }
+
+  static String _piece(int token) => _pieces.putIfAbsent(token, () {
+        final buffer = calloc<ffi.Char>(256);
+        final length = lib.llama_token_piece(token, buffer, 256);
+        final piece = length < 0 ? '' : buffer.cast<Utf8>().toDartString();
+        calloc.free(buffer);
+        return piece;
+      });
+
+  static void _onLogprobs(int session, ffi.Pointer<llama_token_logprob> records,
+      int nRecords, int nTop) {
+    final logprobs = <LlamaLogprob>[];
+
+    for (var i = 0; i < nRecords; i++) {
+      final record = records + i * (1 + nTop);
+
+      logprobs.add(LlamaLogprob(
+        token: record.ref.token,
+        piece: _piece(record.ref.token),
+        logprob: record.ref.logprob,
+        top: [
+          for (var j = 1; j <= nTop; j++)
+            LlamaLogprob(
+              token: (record + j).ref.token,
+              piece: _piece((record + j).ref.token),
+              logprob: (record + j).ref.logprob,
+            ),
+        ],
+      ));
+    }
+
+    lib.llama_free_string(records.cast<ffi.Char>());
+    _sendPort!.send(logprobs);
+  }
 }
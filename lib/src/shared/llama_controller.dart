@@ -16,6 +16,193 @@ class LlamaController extends ChangeNotifier {
     notifyListeners();
   }
 
+  String? _promptCacheDir;
+
+  /// Directory used to persist the KV state of system prompts.
+  ///
+  /// When set, the evaluated system prompt is saved here and restored on the
+  /// next launch instead of being evaluated again. If `null`, nothing is
+  /// cached on disk.
+  String? get promptCacheDir => _promptCacheDir;
+
+  set promptCacheDir(String? value) {
+    _promptCacheDir = value;
+    notifyListeners();
+  }
+
+  String? _sessionDir;
+
+  /// Directory idle sessions are suspended to when their sequence is needed.
+  ///
+  /// If `null`, sessions are never evicted and at most [nSeqMax] sessions
+  /// can exist at once.
+  String? get sessionDir => _sessionDir;
+
+  set sessionDir(String? value) {
+    _sessionDir = value;
+    notifyListeners();
+  }
+
+  int? _sessionMemoryBudget;
+
+  /// Bytes of KV state resident sessions may use before the least recently
+  /// used idle sessions are suspended to [sessionDir].
+  int? get sessionMemoryBudget => _sessionMemoryBudget;
+
+  set sessionMemoryBudget(int? value) {
+    _sessionMemoryBudget = value;
+    notifyListeners();
+  }
+
+  bool? _contextShift;
+
+  /// Indicates whether the oldest tokens are discarded when a conversation
+  /// outgrows the context, instead of stopping the reply.
+  bool? get contextShift => _contextShift;
+
+  set contextShift(bool? value) {
+    _contextShift = value;
+    notifyListeners();
+  }
+
+  int? _nKeep;
+
+  /// The number of leading tokens a context shift keeps.
+  ///
+  /// If `null` or negative, the system prompt is kept.
+  int? get nKeep => _nKeep;
+
+  set nKeep(int? value) {
+    _nKeep = value;
+    notifyListeners();
+  }
+
+  int? _nDraft;
+
+  /// The maximum number of tokens drafted per step by prompt lookup.
+  ///
+  /// Drafts are copied from earlier in the conversation and verified in a
+  /// single decode. If `null` or 0, speculative decoding is disabled.
+  int? get nDraft => _nDraft;
+
+  set nDraft(int? value) {
+    _nDraft = value;
+    notifyListeners();
+  }
+
+  int? _draftNgramMin;
+
+  /// The shortest n-gram prompt lookup may match.
+  int? get draftNgramMin => _draftNgramMin;
+
+  set draftNgramMin(int? value) {
+    _draftNgramMin = value;
+    notifyListeners();
+  }
+
+  int? _draftNgramMax;
+
+  /// The longest n-gram prompt lookup tries to match.
+  int? get draftNgramMax => _draftNgramMax;
+
+  set draftNgramMax(int? value) {
+    _draftNgramMax = value;
+    notifyListeners();
+  }
+
+  String? _draftModelPath;
+
+  /// Path to a small draft model sharing the vocabulary of [modelPath].
+  ///
+  /// If set, drafts come from this model instead of prompt lookup and
+  /// [nDraft] defaults to 8.
+  String? get draftModelPath => _draftModelPath;
+
+  set draftModelPath(String? value) {
+    _draftModelPath = value;
+    notifyListeners();
+  }
+
+  double? _draftPMin;
+
+  /// The minimum probability of a draft token, drafting stops below it.
+  double? get draftPMin => _draftPMin;
+
+  set draftPMin(double? value) {
+    _draftPMin = value;
+    notifyListeners();
+  }
+
+  int? _streamFlushTokens;
+
+  /// The number of generated pieces buffered before they are streamed.
+  ///
+  /// Pieces are always streamed on UTF-8 character boundaries.
+  int? get streamFlushTokens => _streamFlushTokens;
+
+  set streamFlushTokens(int? value) {
+    _streamFlushTokens = value;
+    notifyListeners();
+  }
+
+  int? _streamFlushMs;
+
+  /// The longest a buffered piece waits for [streamFlushTokens] to be
+  /// reached, in milliseconds. If `null` or 0, there is no time limit.
+  int? get streamFlushMs => _streamFlushMs;
+
+  set streamFlushMs(int? value) {
+    _streamFlushMs = value;
+    notifyListeners();
+  }
+
+  int? _outputBufferSize;
+
+  /// The number of bytes of generated output buffered per session.
+  int? get outputBufferSize => _outputBufferSize;
+
+  set outputBufferSize(int? value) {
+    _outputBufferSize = value;
+    notifyListeners();
+  }
+
+  String? _outputBackpressure;
+
+  /// What happens when the output buffer of a session is full.
+  ///
+  /// `block` (the default) pauses the reply until the output is read, `stop`
+  /// ends the reply.
+  String? get outputBackpressure => _outputBackpressure;
+
+  set outputBackpressure(String? value) {
+    _outputBackpressure = value;
+    notifyListeners();
+  }
+
+  int? _tokenCacheSize;
+
+  /// Tokens of long prompt segments kept for reuse across requests and sessions.
+  ///
+  /// System prompts and documents that were tokenized before are taken from
+  /// this cache. Defaults to 65536, 0 disables it.
+  int? get tokenCacheSize => _tokenCacheSize;
+
+  set tokenCacheSize(int? value) {
+    _tokenCacheSize = value;
+    notifyListeners();
+  }
+
+  int? _topLogprobs;
+
+  /// Reports the logprob of every generated token along with the given number
+  /// of most likely alternatives through [Llama.logprobs], null turns it off
+  int? get topLogprobs => _topLogprobs;
+
+  set topLogprobs(int? value) {
+    _topLogprobs = value;
+    notifyListeners();
+  }
+
   bool? _vocabOnly;
 
   /// Indicates whether only the vocabulary should be loaded.
@@ -572,6 +759,54 @@ class LlamaController extends ChangeNotifier {
     notifyListeners();
   }
 
+  String? _jsonSchema;
+
+  /// JSON schema the output has to follow, converted to a grammar.
+  ///
+  /// Used when [grammarStr] is not set. Grammars are cached, so switching
+  /// between a few schemas parses each only once.
+  String? get jsonSchema => _jsonSchema;
+
+  set jsonSchema(String? value) {
+    _jsonSchema = value;
+    notifyListeners();
+  }
+
+  Map<String, double>? _logitBias;
+
+  /// Biases added to the logits of tokens before sampling.
+  ///
+  /// Keys are token ids, or texts whose tokens all get the bias.
+  Map<String, double>? get logitBias => _logitBias;
+
+  set logitBias(Map<String, double>? value) {
+    _logitBias = value;
+    notifyListeners();
+  }
+
+  List<Object>? _bannedTokens;
+
+  /// Tokens that are never sampled, given as token ids or texts.
+  List<Object>? get bannedTokens => _bannedTokens;
+
+  set bannedTokens(List<Object>? value) {
+    _bannedTokens = value;
+    notifyListeners();
+  }
+
+  List<String>? _stop;
+
+  /// Strings that end the reply, matched across token boundaries.
+  ///
+  /// The reply ends right before the first stop string it completes, which is
+  /// never part of the output.
+  List<String>? get stop => _stop;
+
+  set stop(List<String>? value) {
+    _stop = value;
+    notifyListeners();
+  }
+
   int? _penaltiesLastN;
 
   /// Penalties last N
@@ -675,6 +910,22 @@ class LlamaController extends ChangeNotifier {
   /// Creates a new instance of [LlamaController].
   LlamaController({
     required String modelPath,
+    String? promptCacheDir,
+    String? sessionDir,
+    int? sessionMemoryBudget,
+    bool? contextShift,
+    int? nKeep,
+    int? nDraft,
+    int? draftNgramMin,
+    int? draftNgramMax,
+    String? draftModelPath,
+    double? draftPMin,
+    int? streamFlushTokens,
+    int? streamFlushMs,
+    int? outputBufferSize,
+    String? outputBackpressure,
+    int? tokenCacheSize,
+    int? topLogprobs,
     bool? vocabOnly,
     bool? useMmap,
     bool? useMlock,
@@ -729,6 +980,10 @@ class LlamaController extends ChangeNotifier {
     double? mirostatV2Eta,
     String? grammarStr,
     String? grammarRoot,
+    String? jsonSchema,
+    Map<String, double>? logitBias,
+    List<Object>? bannedTokens,
+    List<String>? stop,
     int? penaltiesLastN,
     double? penaltiesRepeat,
     double? penaltiesFrequency,
@@ -738,6 +993,22 @@ class LlamaController extends ChangeNotifier {
     double? drySamplerDryBase,
     int? drySamplerAllowedLength,
   })  : _modelPath = modelPath,
+        _promptCacheDir = promptCacheDir,
+        _sessionDir = sessionDir,
+        _sessionMemoryBudget = sessionMemoryBudget,
+        _contextShift = contextShift,
+        _nKeep = nKeep,
+        _nDraft = nDraft,
+        _draftNgramMin = draftNgramMin,
+        _draftNgramMax = draftNgramMax,
+        _draftModelPath = draftModelPath,
+        _draftPMin = draftPMin,
+        _streamFlushTokens = streamFlushTokens,
+        _streamFlushMs = streamFlushMs,
+        _outputBufferSize = outputBufferSize,
+        _outputBackpressure = outputBackpressure,
+        _tokenCacheSize = tokenCacheSize,
+        _topLogprobs = topLogprobs,
         _vocabOnly = vocabOnly,
         _useMmap = useMmap,
         _useMlock = useMlock,
@@ -792,6 +1063,10 @@ class LlamaController extends ChangeNotifier {
         _mirostatV2Eta = mirostatV2Eta,
         _grammarStr = grammarStr,
         _grammarRoot = grammarRoot,
+        _jsonSchema = jsonSchema,
+        _logitBias = logitBias,
+        _bannedTokens = bannedTokens,
+        _stop = stop,
         _penaltiesLastN = penaltiesLastN,
         _penaltiesRepeat = penaltiesRepeat,
         _penaltiesFrequency = penaltiesFrequency,
@@ -804,6 +1079,22 @@ class LlamaController extends ChangeNotifier {
   /// Creates a new instance from a map.
   factory LlamaController.fromMap(Map<String, dynamic> map) => LlamaController(
         modelPath: map['model_path'],
+        promptCacheDir: map['prompt_cache_dir'],
+        sessionDir: map['session_dir'],
+        sessionMemoryBudget: map['session_memory_budget'],
+        contextShift: map['context_shift'],
+        nKeep: map['n_keep'],
+        nDraft: map['n_draft'],
+        draftNgramMin: map['draft_ngram_min'],
+        draftNgramMax: map['draft_ngram_max'],
+        draftModelPath: map['draft_model_path'],
+        draftPMin: map['draft_p_min'],
+        streamFlushTokens: map['stream_flush_tokens'],
+        streamFlushMs: map['stream_flush_ms'],
+        outputBufferSize: map['output_buffer_size'],
+        outputBackpressure: map['output_backpressure'],
+        tokenCacheSize: map['token_cache_size'],
+        topLogprobs: map['top_logprobs'],
         vocabOnly: map['vocab_only'],
         useMmap: map['use_mmap'],
         useMlock: map['use_mlock'],
@@ -866,6 +1157,11 @@ class LlamaController extends ChangeNotifier {
         mirostatV2Eta: map['mirostat_v2_eta'],
         grammarStr: map['grammar_str'],
         grammarRoot: map['grammar_root'],
+        jsonSchema: map['json_schema'],
+        logitBias: (map['logit_bias'] as Map<String, dynamic>?)
+            ?.map((key, value) => MapEntry(key, (value as num).toDouble())),
+        bannedTokens: (map['banned_tokens'] as List<dynamic>?)?.cast<Object>(),
+        stop: (map['stop'] as List<dynamic>?)?.cast<String>(),
         penaltiesLastN: map['penalties_last_n'],
         penaltiesRepeat: map['penalties_repeat'],
         penaltiesFrequency: map['penalties_frequency'],
@@ -883,6 +1179,22 @@ class LlamaController extends ChangeNotifier {
   /// Converts the current instance to a map.
   Map<String, dynamic> toMap() => {
         'model_path': modelPath,
+        'prompt_cache_dir': promptCacheDir,
+        'session_dir': sessionDir,
+        'session_memory_budget': sessionMemoryBudget,
+        'context_shift': contextShift,
+        'n_keep': nKeep,
+        'n_draft': nDraft,
+        'draft_ngram_min': draftNgramMin,
+        'draft_ngram_max': draftNgramMax,
+        'draft_model_path': draftModelPath,
+        'draft_p_min': draftPMin,
+        'stream_flush_tokens': streamFlushTokens,
+        'stream_flush_ms': streamFlushMs,
+        'output_buffer_size': outputBufferSize,
+        'output_backpressure': outputBackpressure,
+        'token_cache_size': tokenCacheSize,
+        'top_logprobs': topLogprobs,
         'vocab_only': vocabOnly,
         'use_mmap': useMmap,
         'use_mlock': useMlock,
@@ -910,6 +1222,16 @@ class LlamaController extends ChangeNotifier {
         'offload_kqv': offloadKqv,
         'flash_attention': flashAttention,
         'no_perf': noPerformance,
+        ...toSamplerMap(),
+      };
+
+  /// Converts the current instance to a JSON string.
+  String toJson() => jsonEncode(toMap());
+
+  /// Converts the sampling parameters of the current instance to a map.
+  ///
+  /// These are the parameters a prompt can change without reloading the model.
+  Map<String, dynamic> toSamplerMap() => {
         'greedy': _greedy,
         'infill': _infill,
         'seed': _seed,
@@ -937,6 +1259,10 @@ class LlamaController extends ChangeNotifier {
         'mirostat_v2_eta': _mirostatV2Eta,
         'grammar_str': _grammarStr,
         'grammar_root': _grammarRoot,
+        'json_schema': _jsonSchema,
+        'logit_bias': _logitBias,
+        'banned_tokens': _bannedTokens,
+        'stop': _stop,
         'penalties_last_n': _penaltiesLastN,
         'penalties_repeat': _penaltiesRepeat,
         'penalties_frequency': _penaltiesFrequency,
@@ -947,8 +1273,8 @@ class LlamaController extends ChangeNotifier {
         'dry_sampler_allowed_length': _drySamplerAllowedLength,
       };
 
-  /// Converts the current instance to a JSON string.
-  String toJson() => jsonEncode(toMap());
+  /// Converts the sampling parameters of the current instance to a JSON string.
+  String toSamplerJson() => jsonEncode(toSamplerMap());
 }
 
 /// Enum representing different types of rope scaling.
@@ -0,0 +1,35 @@
+/// The log-probability of a token under the model.
+///
+/// Logprobs are reported for the distribution the model produced, before the
+/// samplers reshaped it, so temperature, top-k and the like do not change them.
+///
+/// Properties:
+/// - `token`: The id of the token in the model's vocabulary.
+/// - `piece`: The text of the token.
+/// - `logprob`: The natural logarithm of the token's probability.
+/// - `top`: The most likely tokens at the same position, most likely first.
+///   Empty for the alternatives themselves.
+class LlamaLogprob {
+  /// The id of the token in the model's vocabulary.
+  final int token;
+
+  /// The text of the token, a token may hold part of a multi-byte character.
+  final String piece;
+
+  /// The natural logarithm of the token's probability.
+  final double logprob;
+
+  /// The most likely tokens at the same position, most likely first.
+  final List<LlamaLogprob> top;
+
+  /// Creates a new instance of [LlamaLogprob].
+  const LlamaLogprob({
+    required this.token,
+    required this.piece,
+    required this.logprob,
+    this.top = const [],
+  });
+
+  @override
+  String toString() => 'LlamaLogprob($token, $piece, $logprob)';
+}
@@ -43,6 +43,51 @@ class Llama {
     throw LlamaException('Web not supported');
   }
 
+  /// Generates [n] alternative replies to the same chat messages.
+  ///
+  /// - Parameter messages: The chat to reply to.
+  /// - Parameter n: How many replies to generate.
+  /// - Parameter nPredict: The most tokens of a reply, 0 leaves them to the context.
+  /// - Returns: The replies, complete.
+  Future<List<String>> promptN(List<LlamaMessage> messages, int n,
+      {int nPredict = 0}) async {
+    throw LlamaException('Web not supported');
+  }
+
+  /// The logprobs of the generated tokens, while [LlamaController.topLogprobs]
+  /// is set.
+  Stream<List<LlamaLogprob>> get logprobs =>
+      throw LlamaException('Web not supported');
+
+  /// Computes an embedding vector for each of the provided texts.
+  ///
+  /// - Parameter texts: The texts to embed.
+  /// - Parameter normalize: Whether to scale the vectors to unit length.
+  /// - Returns: One vector per text, in the same order.
+  Future<List<Float32List>> embed(List<String> texts,
+      {bool normalize = true}) async {
+    throw LlamaException('Web not supported');
+  }
+
+  /// Scores how relevant each passage is to the query.
+  ///
+  /// - Parameter query: The query the passages are scored against.
+  /// - Parameter passages: The candidate passages.
+  /// - Returns: One score per passage, in the same order, higher is more relevant.
+  Future<Float32List> rerank(String query, List<String> passages) async {
+    throw LlamaException('Web not supported');
+  }
+
+  /// Scores how likely each candidate is to continue the prompt.
+  ///
+  /// - Parameter prompt: The text the candidates continue.
+  /// - Parameter candidates: The possible continuations.
+  /// - Returns: The summed log-probability of each candidate, in the same order.
+  Future<Float32List> loglikelihood(
+      String prompt, List<String> candidates) async {
+    throw LlamaException('Web not supported');
+  }
+
   /// Stops the current operation or process.
   ///
   /// This method should be called to terminate any ongoing tasks or
@@ -0,0 +1,49 @@
+part of 'package:llama_sdk/llama_sdk.web.dart';
+
+/// A store of embedding vectors searched natively, without copying them to Dart.
+///
+/// Not available on the web.
+class LlamaVectorStore {
+  /// Creates an empty store of [dimension] wide vectors.
+  LlamaVectorStore(int dimension, {bool quantize = false}) {
+    throw LlamaException('Web not supported');
+  }
+
+  /// Opens a store written by [save].
+  factory LlamaVectorStore.open(String path) {
+    throw LlamaException('Web not supported');
+  }
+
+  /// The width of the stored vectors.
+  int get dimension => throw LlamaException('Web not supported');
+
+  /// The number of stored vectors.
+  int get length => throw LlamaException('Web not supported');
+
+  /// Adds [vectors], each labelled with the id at the same position of [ids].
+  void add(List<Float32List> vectors, List<int> ids) {
+    throw LlamaException('Web not supported');
+  }
+
+  /// Clusters the vectors into [lists] lists, 0 drops the index.
+  void buildIndex(int lists) {
+    throw LlamaException('Web not supported');
+  }
+
+  /// Returns the ids and scores of the [k] vectors closest to [query], best
+  /// first.
+  List<(int id, double score)> search(Float32List query,
+      {int k = 10, int probes = 8}) {
+    throw LlamaException('Web not supported');
+  }
+
+  /// Writes the store, its index included, to [path].
+  void save(String path) {
+    throw LlamaException('Web not supported');
+  }
+
+  /// Frees the native memory of the store.
+  void dispose() {
+    throw LlamaException('Web not supported');
+  }
+}
@@ -7,22 +7,166 @@
     #define DART_API __attribute__ ((visibility ("default")))
 #endif
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef void dart_output(const char *buffer);
 
+typedef void dart_progress(int n_processed, int n_total);
+
+typedef void dart_response(int request, char * piece, int status);
+
+/// The log-probability of a token under the model, before sampling
+typedef struct llama_token_logprob {
+    int32_t token;
+    float logprob;
+} llama_token_logprob;
+
+#define LLAMA_LOGPROBS_MAX 64
+
+/// n_records records of 1 + n_top entries, one record per generated piece: the
+/// sampled token, then the n_top most likely tokens, most likely first. Called
+/// before the output of the same pieces, the receiver frees records with
+/// llama_free_string
+typedef void dart_logprobs(int session, llama_token_logprob * records, int n_records, int n_top);
+
 DART_API char * llama_default_params(void);
 
 DART_API int llama_llm_init(char * params);
 
 DART_API int llama_prompt(char * messages, dart_output * output);
 
+/// Returns a request id at once, response gets each piece, to be released with
+/// llama_free_string, then NULL and the status once the reply is complete
+DART_API int llama_submit(char * messages, dart_response * response);
+
+/// Replies to the messages appended so far and appends the reply to them, so
+/// that only new turns have to be passed in
+DART_API int llama_submit_history(dart_response * response);
+
+DART_API int llama_append(char * role, char * content);
+
+/// Drops every message after the first n_messages
+DART_API int llama_truncate(int n_messages);
+
+DART_API void llama_request_cancel(int request);
+
+DART_API void llama_free_string(char * string);
+
+DART_API int llama_start(char * messages);
+
+/// The smallest buffer polling takes, the longest UTF-8 character and its terminator
+#define LLAMA_POLL_MIN_SIZE 5
+
+/// Never blocks, returns the bytes copied, -1 once the reply is complete and -2 on error.
+/// Characters are never split, a buffer smaller than LLAMA_POLL_MIN_SIZE is an error
+DART_API int llama_poll_output(char * buffer, int size);
+
+DART_API void llama_set_progress(dart_progress * progress);
+
+/// Reports the logprobs of every generated token along with its text, NULL
+/// turns them off. Only while no reply is running
+DART_API int llama_set_logprobs(int n_top, dart_logprobs * logprobs);
+
+/// Samples the following requests with a json object of sampler parameters
+/// laid over the init ones, NULL returns to the init ones. Chains are cached by
+/// their parameters, switching between a few of them builds each once. A stop
+/// string or array of them ends the reply right before the first one it
+/// completes, that text is never streamed. Only while no reply is running
+DART_API int llama_set_sampler(char * params);
+
+/// Writes the text of a token, returns its length or -1 if it does not fit
+DART_API int llama_token_piece(int token, char * buffer, int size);
+
+DART_API char * llama_stats(void);
+
 DART_API void llama_llm_stop(void);
 
 DART_API void llama_llm_free(void);
 
+DART_API int llama_session_create(void);
+
+DART_API int llama_session_prompt(int session, char * messages, dart_output * output);
+
+DART_API int llama_session_submit(int session, char * messages, dart_response * response);
+
+DART_API int llama_session_submit_history(int session, dart_response * response);
+
+DART_API int llama_session_append(int session, char * role, char * content);
+
+DART_API int llama_session_truncate(int session, int n_messages);
+
+DART_API int llama_session_start(int session, char * messages);
+
+DART_API int llama_session_poll_output(int session, char * buffer, int size);
+
+DART_API void llama_session_set_progress(int session, dart_progress * progress);
+
+DART_API int llama_session_set_logprobs(int session, int n_top, dart_logprobs * logprobs);
+
+DART_API int llama_session_set_sampler(int session, char * params);
+
+DART_API char * llama_session_stats(int session);
+
+DART_API void llama_session_stop(int session);
+
+DART_API int llama_session_free(int session);
+
+DART_API int llama_session_suspend(int session, char * path);
+
+DART_API int llama_session_resume(int session, char * path);
+
+/// Writes n_texts rows of llama_embedding_size() floats to embeddings, packing
+/// the texts into as few batches as the free sequences allow
+DART_API int llama_embed(char ** texts, int n_texts, float * embeddings, int normalize);
+
+DART_API int llama_embedding_size(void);
+
+/// Scores each passage against the query with a reranking model, packing the
+/// pairs into as few batches as the free sequences allow
+DART_API int llama_rerank(char * query, char ** passages, int n_passages, float * scores);
+
+/// Writes the summed log-probability of each candidate continuing the prompt.
+/// The prompt is decoded once and shared by all candidates
+DART_API int llama_loglikelihood(char * prompt, char ** candidates, int n_candidates, float * logprobs);
+
+/// Generates n replies to the same messages, each sampled with a chain of its
+/// own. The prompt is decoded once and the replies advance together, one
+/// token each per decode. n_predict caps the tokens of a reply, 0 leaves them
+/// to the context, llama_llm_stop ends them where they are. The receiver frees
+/// each reply with llama_free_string
+DART_API int llama_prompt_n(char * messages, int n, int n_predict, char ** replies);
+
+/// Creates an empty store of dim wide vectors, kept as int8 rows when quantize
+/// is set. Returns its id, or -1 on error
+DART_API int llama_vector_store_create(int dim, int quantize);
+
+/// Opens a saved store, returns its id or -1
+DART_API int llama_vector_store_open(char * path);
+
+DART_API int llama_vector_store_save(int store, char * path);
+
+DART_API int llama_vector_store_dim(int store);
+
+DART_API int llama_vector_store_size(int store);
+
+/// Adds n vectors of the store's width, labelled with ids
+DART_API int llama_vector_store_add(int store, float * vectors, int64_t * ids, int n);
+
+/// Clusters the vectors into n_lists lists for faster, approximate searches,
+/// 0 drops the index
+DART_API int llama_vector_store_build_index(int store, int n_lists);
+
+/// Writes the ids and dot products of the k best vectors, best first. An
+/// indexed store scans only the n_probe lists closest to the query. Returns
+/// the number of results written, or -1 on error
+DART_API int llama_vector_store_search(int store, float * query, int k, int n_probe, int64_t * ids, float * scores);
+
+DART_API int llama_vector_store_free(int store);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,75 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+/// Bump allocator for memory that lives for one request. reset() releases
+/// everything at once but keeps the memory, merged into a single block, so a
+/// request no larger than the ones before it does not touch the heap.
+struct llama_arena {
+    std::atomic<uint64_t> * n_allocations = nullptr; // counts the blocks taken from the heap
+
+    void * alloc(size_t size, size_t align = alignof(std::max_align_t)) {
+        size_t offset = (used + align - 1) & ~(align - 1);
+
+        if (blocks.empty() || offset + size > blocks.back().size) {
+            const size_t n = std::max(size, blocks.empty() ? initial_size : blocks.back().size * 2);
+            blocks.push_back({std::unique_ptr<char[]>(new char[n]), n});
+            offset = 0;
+
+            if (n_allocations != nullptr) {
+                (*n_allocations)++;
+            }
+        }
+
+        used = offset + size;
+
+        return blocks.back().data.get() + offset;
+    }
+
+    /// Copies length bytes of text and terminates them
+    char * strdup(const char * text, size_t length) {
+        char * copy = (char *) alloc(length + 1, 1);
+        memcpy(copy, text, length);
+        copy[length] = '\0';
+
+        return copy;
+    }
+
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t size = 0;
+            for (auto & block : blocks) {
+                size += block.size;
+            }
+
+            blocks.clear();
+            blocks.push_back({std::unique_ptr<char[]>(new char[size]), size});
+
+            if (n_allocations != nullptr) {
+                (*n_allocations)++;
+            }
+        }
+
+        used = 0;
+    }
+
+private:
+    struct block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    static constexpr size_t initial_size = 4096;
+
+    std::vector<block> blocks;
+    size_t used = 0; // bytes of the last block in use
+};
+
+#endif
@@ -0,0 +1,3009 @@
+#include "engine.hpp"
+#include "hash.hpp"
+#include "speculative.hpp"
+#include "state.hpp"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <random>
+
+llama_llm_session::~llama_llm_session() {
+    if (smpl != nullptr) {
+        llama_sampler_free(smpl);
+    }
+
+    if (grammar != nullptr) {
+        llama_sampler_free(grammar);
+    }
+}
+
+static void batch_add(llama_batch & batch, llama_token token, llama_pos pos, llama_seq_id seq_id, bool logits) {
+    batch.token[batch.n_tokens] = token;
+    batch.pos[batch.n_tokens] = pos;
+    batch.n_seq_id[batch.n_tokens] = 1;
+    batch.seq_id[batch.n_tokens][0] = seq_id;
+    batch.logits[batch.n_tokens] = logits;
+    batch.n_tokens++;
+}
+
+static bool session_prefilling(const llama_llm_session * session) {
+    return session->n_prompt_done < (int) session->prompt.size();
+}
+
+// must be called with both ctx_mutex and mutex held
+static void session_finish(llama_llm_engine * engine, llama_llm_session * session, int result) {
+    // a failed or interrupted prompt leaves the sequence in an unknown state, start over next time
+    if (result != 0 || session_prefilling(session)) {
+        llama_kv_self_seq_rm(engine->ctx, session->seq_id, -1, -1);
+        session->tokens.clear();
+        session->n_discarded = 0;
+    }
+
+    // the reply ended without completing a stop string, what was held back belongs to it
+    if (result == 0 && !session->stop_held.empty()) {
+        session->output.push(session->stop_held.data(), session->stop_held.size());
+    }
+
+    session->stop_held.clear();
+    session->prompt.clear();
+    session->n_prompt_done = 0;
+    session->save_at = 0;
+    session->finished = true;
+    session->result = result;
+    session->i_batch = -1;
+    session->cv.notify_all();
+}
+
+static bool engine_has_work(llama_llm_engine * engine) {
+    for (auto & [id, session] : engine->sessions) {
+        if (session->active && !session->finished && !session->blocked) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// called from inside llama_decode, lets a stop land within one ubatch of a long prefill
+static bool engine_abort(void * data) {
+    auto engine = (llama_llm_engine *) data;
+
+    for (auto session : engine->scheduled) {
+        if (session->step_prompt > 0 && session->stop.load()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// must be called with both ctx_mutex and mutex held
+static void session_rollback(llama_llm_engine * engine, llama_llm_session * session) {
+    llama_kv_self_seq_rm(engine->ctx, session->seq_id, session->step_pos, -1);
+    session->tokens.resize(session->step_pos);
+    session->n_prompt_done -= session->step_prompt;
+    session->step_prompt = 0;
+    session->i_batch = -1;
+}
+
+// must be called with both ctx_mutex and mutex held
+// makes room for n_tokens more tokens by repeatedly discarding the older half of what follows the sink tokens
+static bool session_shift(llama_llm_engine * engine, llama_llm_session * session, int n_ctx_seq, int n_tokens) {
+    if (!engine->context_shift) {
+        return false;
+    }
+
+    auto & tokens = session->tokens;
+
+    while ((int) tokens.size() + n_tokens > n_ctx_seq) {
+        const size_t n_keep = std::min(session->n_sink, tokens.size());
+        const size_t n_left = tokens.size() - n_keep;
+        if (n_left == 0) {
+            return false;
+        }
+
+        const size_t n_discard = std::max<size_t>(n_left / 2, 1);
+
+        llama_kv_self_seq_rm(engine->ctx, session->seq_id, n_keep, n_keep + n_discard);
+        llama_kv_self_seq_add(engine->ctx, session->seq_id, n_keep + n_discard, -1, -(llama_pos) n_discard);
+
+        tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_keep + n_discard);
+        session->n_discarded += n_discard;
+
+        // the cached prefix has to be captured from an unshifted sequence
+        session->save_at = 0;
+    }
+
+    return true;
+}
+
+// exp(x) for x <= 0 within 2e-7, in plain arithmetic so the loops calling it vectorize
+static inline float exp_nonpositive(float x) {
+    // clamped to -87 on the bits, a float compare would keep the compiler from vectorizing
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bits = std::min<uint32_t>(bits & 0x7fffffff, 0x42ae0000) | 0x80000000;
+    memcpy(&x, &bits, sizeof(bits));
+
+    // x = k ln2 + r, exp(r) by its polynomial and 2^k into the exponent
+    const float k = (x * 1.44269504f + 12582912.0f) - 12582912.0f;
+    const float r = x - k * 0.693145751953125f - k * 1.428606765330187e-06f;
+
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+
+    int32_t scaled;
+    memcpy(&scaled, &p, sizeof(scaled));
+    scaled += (int32_t) k * (1 << 23);
+    memcpy(&p, &scaled, sizeof(scaled));
+
+    return p;
+}
+
+// appends the logprob of token and the n_top most likely tokens, most likely first, found with a
+// heap of n_top entries in one pass instead of sorting the vocabulary
+static void token_top_logprobs(const float * logits, int n_vocab, llama_token token, int n_top, std::vector<llama_token_logprob> & out) {
+    const size_t start = out.size();
+    out.resize(start + 1 + n_top);
+
+    llama_token_logprob * top = out.data() + start + 1;
+    auto greater = [](const llama_token_logprob & a, const llama_token_logprob & b) { return a.logprob > b.logprob; };
+
+    // independent lanes break the dependency between iterations, and let the sums vectorize
+    // without reordering a single accumulator
+    float lanes[8];
+    std::fill(lanes, lanes + 8, -INFINITY);
+
+    int i = 0;
+    for (; i + 8 <= n_vocab; i += 8) {
+        for (int j = 0; j < 8; j++) {
+            lanes[j] = std::max(lanes[j], logits[i + j]);
+        }
+    }
+
+    float max = *std::max_element(lanes, lanes + 8);
+    for (; i < n_vocab; i++) {
+        max = std::max(max, logits[i]);
+    }
+
+    // past the first n_top tokens the heap is rarely touched
+    int n = 0;
+    for (llama_token id = 0; id < n_vocab && n_top > 0; id++) {
+        if (n < n_top) {
+            top[n++] = {id, logits[id]};
+            std::push_heap(top, top + n, greater);
+        }
+        else if (logits[id] > top[0].logprob) {
+            std::pop_heap(top, top + n, greater);
+            top[n - 1] = {id, logits[id]};
+            std::push_heap(top, top + n, greater);
+        }
+    }
+
+    std::fill(lanes, lanes + 8, 0.0f);
+
+    i = 0;
+    for (; i + 8 <= n_vocab; i += 8) {
+        for (int j = 0; j < 8; j++) {
+            lanes[j] += exp_nonpositive(logits[i + j] - max);
+        }
+    }
+
+    float sum = 0.0f;
+    for (; i < n_vocab; i++) {
+        sum += exp_nonpositive(logits[i] - max);
+    }
+    for (float lane : lanes) {
+        sum += lane;
+    }
+
+    const float log_sum = max + std::log(sum);
+
+    std::sort_heap(top, top + n, greater);
+    for (int i = 0; i < n; i++) {
+        top[i].logprob -= log_sum;
+    }
+
+    out[start] = {token, logits[token] - log_sum};
+}
+
+// samples from the logits of output idx like llama_sampler_sample, but checks the grammar against the
+// chosen token alone and only masks the whole vocabulary with it when the chain chose a token the
+// grammar rejects, which the model mostly does not once it follows the grammar
+static llama_token sample_constrained(llama_context * ctx, llama_sampler * smpl, llama_sampler * grammar, int32_t idx, std::vector<llama_token_data> & cur) {
+    if (grammar == nullptr) {
+        return llama_sampler_sample(smpl, ctx, idx);
+    }
+
+    const float * logits = llama_get_logits_ith(ctx, idx);
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+
+    auto fill = [&] {
+        cur.resize(n_vocab);
+        for (llama_token id = 0; id < n_vocab; id++) {
+            cur[id] = {id, logits[id], 0.0f};
+        }
+        return llama_token_data_array{cur.data(), cur.size(), -1, false};
+    };
+
+    llama_token_data_array cur_p = fill();
+    llama_sampler_apply(smpl, &cur_p);
+    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int64_t) cur_p.size);
+
+    llama_token token = cur_p.data[cur_p.selected].id;
+
+    llama_token_data single = {token, 1.0f, 0.0f};
+    llama_token_data_array single_p = {&single, 1, -1, false};
+    llama_sampler_apply(grammar, &single_p);
+
+    if (single.logit == -INFINITY) {
+        cur_p = fill();
+        llama_sampler_apply(grammar, &cur_p);
+        llama_sampler_apply(smpl, &cur_p);
+        GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int64_t) cur_p.size);
+
+        token = cur_p.data[cur_p.selected].id;
+    }
+
+    llama_sampler_accept(grammar, token);
+    llama_sampler_accept(smpl, token);
+
+    return token;
+}
+
+// bytes a logprob record of the session takes in its ring
+static size_t session_record_size(const llama_llm_session * session) {
+    return sizeof(uint16_t) + (1 + session->n_top) * sizeof(llama_token_logprob);
+}
+
+// whether the output rings of the session have room for all a generating step can write
+static bool session_has_room(const llama_llm_engine * engine, const llama_llm_session * session) {
+    // held back text goes out with a later piece, or as a piece of its own when the reply ends
+    const size_t n_held = session->stop_strings != nullptr ? sizeof(uint16_t) + session->stop_strings->max_length : 0;
+
+    if (session->output.space() < engine->output_reserve + n_held) {
+        return false;
+    }
+
+    return session->logprobs == nullptr || session->records.space() >= (std::max(engine->n_draft, 0) + 1) * session_record_size(session);
+}
+
+// pushes a piece of the reply, minus the bytes at its end that could still begin a stop string, those
+// are held back until the text after them decides. Returns true once a stop string completed, the
+// reply then ends right before it
+static bool session_push_piece(llama_llm_session * session, const char * piece, int n) {
+    const llama_stop_automaton * stop = session->stop_strings.get();
+    if (stop == nullptr) {
+        session->output.push(piece, n);
+        return false;
+    }
+
+    // the held bytes are those the automaton state stands for, only the new ones are fed
+    std::string & held = session->stop_held;
+    const size_t n_held = held.size();
+    held.append(piece, n);
+
+    for (size_t i = n_held; i < held.size(); i++) {
+        session->stop_state = stop->next(session->stop_state, held[i]);
+
+        if (const uint32_t n_match = stop->match(session->stop_state)) {
+            if (i + 1 > n_match) {
+                session->output.push(held.data(), i + 1 - n_match);
+            }
+            session->stop_state = 0;
+            held.clear();
+            return true;
+        }
+    }
+
+    // an empty piece would count as one for the caller without ever flushing
+    const size_t n_release = held.size() - stop->depth(session->stop_state);
+    if (n_release > 0) {
+        session->output.push(held.data(), n_release);
+        held.erase(0, n_release);
+    }
+
+    return false;
+}
+
+static void engine_loop(llama_llm_engine * engine) {
+    auto vocab = llama_model_get_vocab(engine->model);
+    auto & batch = engine->batch;
+    auto & scheduled = engine->scheduled;
+
+    const int n_batch = llama_n_batch(engine->ctx);
+    const int n_ubatch = llama_n_ubatch(engine->ctx);
+    const int n_ctx_seq = llama_n_ctx(engine->ctx) / llama_n_seq_max(engine->ctx);
+
+    // reused by every step so decoding does not allocate once they have grown
+    std::vector<llama_llm_session *> generating;
+    std::vector<llama_draft_request> draft_requests;
+    std::vector<llama_token> new_tokens;
+    std::vector<llama_token_logprob> new_logprobs;
+    std::vector<llama_token_data> candidates;
+
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(engine->mutex);
+            engine->cv.wait(lock, [&] { return !engine->running || engine_has_work(engine); });
+
+            if (!engine->running) {
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+        std::unique_lock<std::mutex> lock(engine->mutex);
+
+        batch.n_tokens = 0;
+        scheduled.clear();
+
+        generating.clear();
+
+        // sessions that are generating go first so every running reply advances each step
+        for (auto & [id, session] : engine->sessions) {
+            if (!session->active || session->finished || session_prefilling(session.get())) {
+                continue;
+            }
+
+            if (session->stop.load()) {
+                session_finish(engine, session.get(), 0);
+                continue;
+            }
+
+            // a step can write a piece per drafted token, a slow reader holds the reply back or ends it
+            if (!session_has_room(engine, session.get())) {
+                if (!engine->output_block) {
+                    fprintf(stderr, "output of session %d is not read fast enough\n", session->id);
+                    session_finish(engine, session.get(), 0);
+                    continue;
+                }
+
+                // pairs with the fence in session_drain, either it sees blocked or this sees the room
+                session->blocked = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!session_has_room(engine, session.get())) {
+                    continue;
+                }
+                session->blocked = false;
+            }
+
+            if ((int) session->tokens.size() + 1 > n_ctx_seq && !session_shift(engine, session.get(), n_ctx_seq, 1)) {
+                fprintf(stderr, "context size exceeded\n");
+                session_finish(engine, session.get(), 0);
+                continue;
+            }
+
+            session->draft.clear();
+            generating.push_back(session.get());
+        }
+
+        // draft tokens are decoded along with the sampled ones, each reply gets an equal share of the batch
+        const int n_draft_max = generating.empty() ? 0 : std::min(engine->n_draft, n_batch / (int) generating.size() - 1);
+
+        if (n_draft_max > 0) {
+            draft_requests.clear();
+
+            for (auto session : generating) {
+                const int n_draft = std::min(n_draft_max, n_ctx_seq - (int) session->tokens.size() - 1);
+
+                if (engine->draft != nullptr && n_draft > 0) {
+                    draft_requests.push_back({session->seq_id, &session->tokens, session->sampled, n_draft, &session->draft});
+                }
+                else {
+                    llama_ngram_draft(session->tokens, session->sampled, engine->draft_ngram_min, engine->draft_ngram_max, n_draft, session->draft);
+                }
+            }
+
+            // callers need ctx_mutex to touch the tokens of a session, so drafting can go without mutex
+            if (!draft_requests.empty()) {
+                lock.unlock();
+                llama_draft_generate(engine->draft, draft_requests);
+                lock.lock();
+            }
+        }
+
+        for (auto session : generating) {
+            session->step_pos = session->tokens.size();
+            session->step_prompt = 0;
+            session->i_batch = batch.n_tokens;
+            batch_add(batch, session->sampled, session->tokens.size(), session->seq_id, true);
+            session->tokens.push_back(session->sampled);
+
+            for (auto token : session->draft) {
+                batch_add(batch, token, session->tokens.size(), session->seq_id, true);
+                session->tokens.push_back(token);
+            }
+
+            scheduled.push_back(session);
+        }
+
+        // prompts are fed in chunks that fill the rest of the batch, or a single ubatch
+        // while other replies are streaming so they are not held up by a long prefill
+        const int n_prefill_max = batch.n_tokens > 0 ? std::min(n_ubatch, n_batch - batch.n_tokens) : n_batch;
+        int n_prefill = 0;
+
+        for (auto & [id, session] : engine->sessions) {
+            if (!session->active || session->finished || !session_prefilling(session.get())) {
+                continue;
+            }
+
+            if (session->stop.load()) {
+                session_finish(engine, session.get(), 0);
+                continue;
+            }
+
+            const int n_remaining = session->prompt.size() - session->n_prompt_done;
+
+            if (!engine->context_shift && (int) session->tokens.size() + n_remaining > n_ctx_seq) {
+                fprintf(stderr, "context size exceeded\n");
+                session_finish(engine, session.get(), 0);
+                continue;
+            }
+
+            int n_take = std::min(n_remaining, n_prefill_max - n_prefill);
+            if (n_take <= 0) {
+                break;
+            }
+
+            // end the chunk on the cached prefix boundary so its state can be captured
+            if (session->save_at > session->tokens.size()) {
+                n_take = std::min(n_take, (int) (session->save_at - session->tokens.size()));
+            }
+
+            // a prompt longer than the context slides through it, chunk by chunk
+            if ((int) session->tokens.size() + n_take > n_ctx_seq) {
+                n_take = std::min(n_take, n_ctx_seq - (int) session->n_sink);
+                if (n_take <= 0 || !session_shift(engine, session.get(), n_ctx_seq, n_take)) {
+                    fprintf(stderr, "context size exceeded\n");
+                    session_finish(engine, session.get(), 0);
+                    continue;
+                }
+            }
+
+            session->step_pos = session->tokens.size();
+            session->step_prompt = n_take;
+            session->i_batch = -1;
+
+            for (int i = 0; i < n_take; i++) {
+                const llama_token token = session->prompt[session->n_prompt_done++];
+                batch_add(batch, token, session->tokens.size(), session->seq_id, false);
+                session->tokens.push_back(token);
+            }
+
+            n_prefill += n_take;
+
+            if (!session_prefilling(session.get())) {
+                batch.logits[batch.n_tokens - 1] = true;
+                session->i_batch = batch.n_tokens - 1;
+            }
+
+            scheduled.push_back(session.get());
+        }
+
+        if (batch.n_tokens == 0) {
+            continue;
+        }
+
+        lock.unlock();
+        const int ret = llama_decode(engine->ctx, batch);
+        lock.lock();
+
+        if (ret == 2) {
+            // aborted by a stop, everyone in the batch retries the step and the stopped sessions finish
+            for (auto session : scheduled) {
+                session_rollback(engine, session);
+            }
+            scheduled.clear();
+            continue;
+        }
+
+        if (ret != 0) {
+            fprintf(stderr, "failed to decode\n");
+            for (auto session : scheduled) {
+                session_finish(engine, session, 1);
+            }
+            scheduled.clear();
+            continue;
+        }
+
+        for (auto session : scheduled) {
+            if (session->finished) {
+                continue;
+            }
+
+            if (session->save_at > 0 && session->tokens.size() == session->save_at) {
+                llama_seq_state_get(engine->ctx, session->seq_id, session->saved_state);
+                session->save_at = 0;
+            }
+
+            if (session->i_batch < 0) {
+                // a prompt chunk, let the caller report progress
+                session->cv.notify_all();
+                continue;
+            }
+
+            // sample the next token, and the one after each draft token for as long as the draft agrees
+            new_tokens.clear();
+            new_logprobs.clear();
+            bool is_eog = false;
+            size_t n_accepted = 0;
+
+            while (true) {
+                const int32_t i_logits = session->i_batch + n_accepted;
+                const llama_token new_token_id = sample_constrained(engine->ctx, session->smpl, session->grammar, i_logits, candidates);
+
+                // is it an end of generation?
+                if (llama_vocab_is_eog(vocab, new_token_id)) {
+                    is_eog = true;
+                    break;
+                }
+
+                new_tokens.push_back(new_token_id);
+
+                // scored against the model's distribution, before the samplers reshaped it
+                if (session->logprobs != nullptr) {
+                    token_top_logprobs(llama_get_logits_ith(engine->ctx, i_logits), n_vocab, new_token_id, session->n_top, new_logprobs);
+                }
+
+                if (n_accepted < session->draft.size() && new_token_id == session->draft[n_accepted]) {
+                    n_accepted++;
+                    continue;
+                }
+
+                break;
+            }
+
+            session->i_batch = -1;
+
+            // rejected draft tokens are dropped from the cache
+            if (n_accepted < session->draft.size()) {
+                session->tokens.resize(session->step_pos + 1 + n_accepted);
+                llama_kv_self_seq_rm(engine->ctx, session->seq_id, session->tokens.size(), -1);
+            }
+
+            session->n_generated += new_tokens.size();
+            session->n_steps++;
+            session->n_drafted += session->draft.size();
+            session->n_accepted += n_accepted;
+            session->draft.clear();
+
+            // convert the tokens to strings and hand them to the caller
+            bool failed = false;
+            bool stopped = false;
+            for (size_t i = 0; i < new_tokens.size() && !stopped; i++) {
+                char buf[256];
+                int n = llama_token_to_piece(vocab, new_tokens[i], buf, sizeof(buf), 0, true);
+                if (n < 0) {
+                    failed = true;
+                    break;
+                }
+
+                stopped = session_push_piece(session, buf, n);
+
+                if (session->logprobs != nullptr) {
+                    const size_t n_entries = 1 + session->n_top;
+                    session->records.push((const char *) (new_logprobs.data() + i * n_entries), n_entries * sizeof(llama_token_logprob));
+                }
+            }
+
+            if (failed) {
+                fprintf(stderr, "failed to convert token to piece\n");
+                session_finish(engine, session, 1);
+                continue;
+            }
+
+            if (is_eog || stopped) {
+                session_finish(engine, session, 0);
+                continue;
+            }
+
+            session->sampled = new_tokens.back();
+            session->cv.notify_all();
+        }
+
+        scheduled.clear();
+    }
+
+    std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    for (auto & [id, session] : engine->sessions) {
+        if (session->active && !session->finished) {
+            session_finish(engine, session.get(), 1);
+        }
+    }
+}
+
+static void session_remove_state(llama_llm_session * session) {
+    if (session->state_owned) {
+        std::error_code ec;
+        std::filesystem::remove(std::filesystem::u8path(session->state_path), ec);
+    }
+
+    session->state_path.clear();
+    session->state_owned = false;
+}
+
+// identifies the model file and the context parameters that affect what ends up in the KV cache
+static uint64_t prefix_cache_key(json & params) {
+    std::error_code ec;
+    const std::filesystem::path path = std::filesystem::canonical(params["model_path"].get<std::string>(), ec);
+
+    std::string identity = path.string();
+    identity += ":" + std::to_string(std::filesystem::file_size(path, ec));
+    identity += ":" + std::to_string(std::filesystem::last_write_time(path, ec).time_since_epoch().count());
+
+    static const char * keys[] = {
+        "n_ctx", "rope_scaling_type", "rope_freq_base", "rope_freq_scale", "yarn_ext_factor",
+        "yarn_attn_factor", "yarn_beta_fast", "yarn_beta_slow", "yarn_orig_ctx", "flash_attn",
+    };
+
+    for (auto key : keys) {
+        if (params.contains(key)) {
+            identity += std::string(":") + key + "=" + params[key].dump();
+        }
+    }
+
+    return fnv1a_hash(identity);
+}
+
+// counts a heap allocation if a buffer that is reused across requests had to grow while it was in scope
+template <typename T>
+struct growth_counter {
+    std::atomic<uint64_t> & n_allocations;
+    const T & buffer;
+    const size_t capacity;
+
+    growth_counter(std::atomic<uint64_t> & n_allocations, const T & buffer) : n_allocations(n_allocations), buffer(buffer), capacity(buffer.capacity()) {}
+
+    ~growth_counter() {
+        if (buffer.capacity() != capacity) {
+            n_allocations++;
+        }
+    }
+};
+
+// appends the tokens of text to a reused buffer, a first guess of one token per byte spares the counting pass
+static void tokenize_append(const llama_vocab * vocab, const char * text, size_t length, bool add_special, std::vector<llama_token> & tokens) {
+    const size_t n_before = tokens.size();
+    tokens.resize(std::max(tokens.capacity(), n_before + length + 2));
+
+    int n_tokens = llama_tokenize(vocab, text, length, tokens.data() + n_before, tokens.size() - n_before, add_special, true);
+    if (n_tokens < 0) {
+        tokens.resize(n_before - n_tokens);
+        n_tokens = llama_tokenize(vocab, text, length, tokens.data() + n_before, tokens.size() - n_before, add_special, true);
+    }
+
+    if (n_tokens < 0) {
+        GGML_ABORT("failed to tokenize the prompt\n");
+    }
+
+    tokens.resize(n_before + n_tokens);
+}
+
+static void tokenize(const llama_vocab * vocab, const char * text, size_t length, bool add_special, std::vector<llama_token> & tokens) {
+    tokens.clear();
+    tokenize_append(vocab, text, length, add_special, tokens);
+}
+
+// renders messages with the chat template into a reused buffer, the rendered length or -1
+static int render(const char * tmpl, const llama_chat_message * messages, size_t n_messages, bool add_ass, std::vector<char> & formatted) {
+    int length = llama_chat_apply_template(tmpl, messages, n_messages, add_ass, formatted.data(), formatted.size());
+    if (length > (int) formatted.size()) {
+        formatted.resize(length);
+        length = llama_chat_apply_template(tmpl, messages, n_messages, add_ass, formatted.data(), formatted.size());
+    }
+
+    return length;
+}
+
+// whether the chat template renders every message on its own, then a chat rendered in two parts
+// tokenizes the same as when it is rendered whole and only appended messages have to be rendered
+static bool chat_template_incremental(llama_llm_engine * engine) {
+    const char * tmpl = llama_model_chat_template(engine->model, nullptr);
+    auto vocab = llama_model_get_vocab(engine->model);
+
+    const llama_chat_message chat[] = {
+        {"system", "You are a helpful assistant."},
+        {"user", "Hello there."},
+        {"assistant", "Hi! How can I help you today?"},
+        {"user", "Tell me a joke."},
+    };
+    const size_t n_chat = sizeof(chat) / sizeof(chat[0]);
+
+    std::vector<char> formatted;
+    std::vector<llama_token> whole;
+    std::vector<llama_token> parts;
+
+    for (bool add_ass : {false, true}) {
+        int length = render(tmpl, chat, n_chat, add_ass, formatted);
+        if (length < 0) {
+            return false;
+        }
+
+        tokenize(vocab, formatted.data(), length, true, whole);
+
+        for (size_t split = 1; split < n_chat; split++) {
+            length = render(tmpl, chat, split, false, formatted);
+            if (length < 0) {
+                return false;
+            }
+
+            tokenize(vocab, formatted.data(), length, true, parts);
+
+            length = render(tmpl, chat + split, n_chat - split, add_ass, formatted);
+            if (length < 0) {
+                return false;
+            }
+
+            tokenize_append(vocab, formatted.data(), length, false, parts);
+
+            if (parts != whole) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+llama_llm_engine * llama_engine_init(llama_model * model, llama_context * ctx, llama_draft * draft, json & params) {
+    assert(model != nullptr);
+    assert(ctx != nullptr);
+
+    auto engine = new llama_llm_engine();
+
+    engine->model = model;
+    engine->ctx = ctx;
+    engine->draft = draft;
+    engine->params = params;
+    engine->seq_used.assign(llama_n_seq_max(ctx), false);
+
+    if (params.contains("embeddings") && params["embeddings"].is_boolean()) {
+        engine->embeddings = params["embeddings"];
+    }
+
+    if (params.contains("session_dir") && params["session_dir"].is_string()) {
+        std::error_code ec;
+        engine->session_dir = params["session_dir"].get<std::string>();
+        std::filesystem::create_directories(std::filesystem::u8path(engine->session_dir), ec);
+        if (ec) {
+            fprintf(stderr, "failed to create session directory %s: %s\n", engine->session_dir.c_str(), ec.message().c_str());
+            engine->session_dir.clear();
+        }
+    }
+
+    if (params.contains("session_memory_budget") && params["session_memory_budget"].is_number_integer()) {
+        engine->session_budget = params["session_memory_budget"].get<size_t>();
+    }
+
+    if (params.contains("context_shift") && params["context_shift"].is_boolean()) {
+        engine->context_shift = params["context_shift"];
+    }
+
+    if (engine->context_shift && !llama_kv_self_can_shift(ctx)) {
+        fprintf(stderr, "the model does not support context shifting, replies stop when the context is full\n");
+        engine->context_shift = false;
+    }
+
+    if (params.contains("n_keep") && params["n_keep"].is_number_integer()) {
+        engine->n_keep = params["n_keep"];
+    }
+
+    if (params.contains("n_draft") && params["n_draft"].is_number_integer()) {
+        engine->n_draft = params["n_draft"];
+    }
+    else if (draft != nullptr) {
+        engine->n_draft = 8;
+    }
+
+    if (params.contains("draft_ngram_min") && params["draft_ngram_min"].is_number_integer()) {
+        engine->draft_ngram_min = params["draft_ngram_min"];
+    }
+
+    if (params.contains("draft_ngram_max") && params["draft_ngram_max"].is_number_integer()) {
+        engine->draft_ngram_max = params["draft_ngram_max"];
+    }
+
+    if (params.contains("stream_flush_tokens") && params["stream_flush_tokens"].is_number_integer()) {
+        engine->stream_flush_tokens = std::max(1, params["stream_flush_tokens"].get<int32_t>());
+    }
+
+    if (params.contains("stream_flush_ms") && params["stream_flush_ms"].is_number_integer()) {
+        engine->stream_flush_ms = std::max(0, params["stream_flush_ms"].get<int32_t>());
+    }
+
+    if (params.contains("output_buffer_size") && params["output_buffer_size"].is_number_integer()) {
+        engine->output_size = params["output_buffer_size"].get<size_t>();
+    }
+
+    if (params.contains("output_backpressure") && params["output_backpressure"].is_string()) {
+        engine->output_block = params["output_backpressure"].get<std::string>() != "stop";
+    }
+
+    // every piece is at most 256 bytes plus its length
+    engine->output_reserve = (std::max(engine->n_draft, 0) + 1) * (sizeof(uint16_t) + 256);
+    engine->output_size = std::max(engine->output_size, 2 * engine->output_reserve);
+
+    if (params.contains("token_cache_size") && params["token_cache_size"].is_number_integer()) {
+        engine->token_cache.capacity = std::max<int64_t>(0, params["token_cache_size"].get<int64_t>());
+    }
+
+    if (params.contains("prompt_cache_dir") && params["prompt_cache_dir"].is_string()) {
+        std::error_code ec;
+        engine->cache_dir = params["prompt_cache_dir"].get<std::string>();
+        std::filesystem::create_directories(std::filesystem::u8path(engine->cache_dir), ec);
+        if (ec) {
+            fprintf(stderr, "failed to create prompt cache directory %s: %s\n", engine->cache_dir.c_str(), ec.message().c_str());
+            engine->cache_dir.clear();
+        }
+        else {
+            engine->cache_key = prefix_cache_key(params);
+        }
+    }
+
+    engine->chat_incremental = chat_template_incremental(engine);
+
+    engine->batch = llama_batch_init(llama_n_batch(ctx), 0, 1);
+
+    llama_set_abort_callback(ctx, engine_abort, engine);
+
+    engine->running = true;
+    engine->worker = std::thread(engine_loop, engine);
+
+    return engine;
+}
+
+void llama_engine_free(llama_llm_engine * engine) {
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+        engine->running = false;
+        engine->cv.notify_all();
+    }
+
+    if (engine->worker.joinable()) {
+        engine->worker.join();
+    }
+
+    // wait for prompt calls still draining their output
+    std::map<int, std::thread> deliveries;
+
+    {
+        std::unique_lock<std::mutex> lock(engine->mutex);
+        engine->cv.wait(lock, [&] { return engine->n_callers == 0; });
+        deliveries.swap(engine->deliveries);
+    }
+
+    for (auto & [request, thread] : deliveries) {
+        thread.join();
+    }
+
+    for (auto & [id, session] : engine->sessions) {
+        session_remove_state(session.get());
+    }
+
+    engine->sessions.clear();
+
+    if (engine->draft != nullptr) {
+        llama_draft_free(engine->draft);
+    }
+
+    llama_batch_free(engine->batch);
+    llama_free(engine->ctx);
+    llama_model_free(engine->model);
+
+    delete engine;
+}
+
+// the held back text has to fit the output ring next to a step, or the scheduler would wait for room forever,
+// and go out with a piece in one ring entry
+static bool stop_strings_fit(const llama_llm_engine * engine, const llama_stop_automaton * stop) {
+    if (stop == nullptr) {
+        return true;
+    }
+
+    if (stop->max_length > UINT16_MAX - 256) {
+        fprintf(stderr, "stop strings can be at most %d bytes\n", UINT16_MAX - 256);
+        return false;
+    }
+
+    if (engine->output_reserve + sizeof(uint16_t) + stop->max_length > engine->output_size) {
+        fprintf(stderr, "stop strings of up to %zu bytes need a larger output_buffer_size\n", stop->max_length);
+        return false;
+    }
+
+    return true;
+}
+
+int llama_engine_session_create(llama_llm_engine * engine) {
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    // sessions only hold a sequence while resident, without eviction there is one session per sequence
+    if (engine->session_dir.empty() && engine->sessions.size() >= engine->seq_used.size()) {
+        fprintf(stderr, "no free sequence for a new session (n_seq_max = %zu)\n", engine->seq_used.size());
+        return -1;
+    }
+
+    auto session = std::make_shared<llama_llm_session>();
+    session->smpl = engine->samplers.clone(engine->model, engine->params, "", &session->grammar, &session->stop_strings);
+    if (session->smpl == nullptr) {
+        return -1;
+    }
+
+    // the destructor frees the chains
+    if (!stop_strings_fit(engine, session->stop_strings.get())) {
+        return -1;
+    }
+
+    session->id = engine->next_id++;
+    session->output.init(engine->output_size);
+    session->arena.n_allocations = &engine->n_allocations;
+    session->tokens.reserve(llama_n_ctx(engine->ctx) / llama_n_seq_max(engine->ctx));
+
+    engine->sessions[session->id] = session;
+
+    return session->id;
+}
+
+static std::string session_file_path(llama_llm_engine * engine, int id) {
+    return (std::filesystem::u8path(engine->session_dir) / ("session-" + std::to_string(id) + ".state")).u8string();
+}
+
+// must be called with the session's busy mutex held
+static bool session_suspend(llama_llm_engine * engine, llama_llm_session * session, const std::string & path, bool owned) {
+    if (session->seq_id < 0) {
+        if (session->state_path.empty()) {
+            return llama_seq_state_write(path, {}, {});
+        }
+
+        if (session->state_path == path) {
+            return true;
+        }
+
+        std::error_code ec;
+        std::filesystem::copy_file(std::filesystem::u8path(session->state_path), std::filesystem::u8path(path), std::filesystem::copy_options::overwrite_existing, ec);
+        if (ec) {
+            fprintf(stderr, "failed to copy %s: %s\n", session->state_path.c_str(), ec.message().c_str());
+            return false;
+        }
+
+        session_remove_state(session);
+        session->state_path = path;
+        session->state_owned = owned;
+        return true;
+    }
+
+    std::vector<uint8_t> data;
+    std::vector<llama_token> tokens;
+
+    {
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+
+        if (!llama_seq_state_get(engine->ctx, session->seq_id, data)) {
+            fprintf(stderr, "failed to get the state of session %d\n", session->id);
+            return false;
+        }
+
+        tokens = session->tokens;
+    }
+
+    // the session is idle and still resident while writing, a failed write loses nothing
+    if (!llama_seq_state_write(path, tokens, data)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    llama_kv_self_seq_rm(engine->ctx, session->seq_id, -1, -1);
+    engine->seq_used[session->seq_id] = false;
+    session->seq_id = -1;
+    session->tokens.clear();
+
+    session_remove_state(session);
+    session->state_path = path;
+    session->state_owned = owned;
+
+    return true;
+}
+
+// idle resident sessions other than self, least recently used first, with their busy mutex locked
+static std::shared_ptr<llama_llm_session> engine_lock_victim(llama_llm_engine * engine, llama_llm_session * self) {
+    std::vector<std::shared_ptr<llama_llm_session>> candidates;
+
+    for (auto & [id, session] : engine->sessions) {
+        if (session.get() != self && session->seq_id >= 0 && !session->active) {
+            candidates.push_back(session);
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const auto & a, const auto & b) {
+        return a->last_used < b->last_used;
+    });
+
+    for (auto & session : candidates) {
+        if (session->busy.try_lock()) {
+            return session;
+        }
+    }
+
+    return nullptr;
+}
+
+static bool engine_evict(llama_llm_engine * engine, std::shared_ptr<llama_llm_session> victim) {
+    const bool suspended = session_suspend(engine, victim.get(), session_file_path(engine, victim->id), true);
+    victim->busy.unlock();
+
+    return suspended;
+}
+
+static llama_seq_id engine_acquire_seq(llama_llm_engine * engine, llama_llm_session * self) {
+    while (true) {
+        std::shared_ptr<llama_llm_session> victim;
+
+        {
+            std::lock_guard<std::mutex> lock(engine->mutex);
+
+            auto it = std::find(engine->seq_used.begin(), engine->seq_used.end(), false);
+            if (it != engine->seq_used.end()) {
+                *it = true;
+                return it - engine->seq_used.begin();
+            }
+
+            if (!engine->session_dir.empty()) {
+                victim = engine_lock_victim(engine, self);
+            }
+        }
+
+        if (victim == nullptr) {
+            fprintf(stderr, "no free sequence for session %d (n_seq_max = %zu)\n", self->id, engine->seq_used.size());
+            return -1;
+        }
+
+        if (!engine_evict(engine, victim)) {
+            return -1;
+        }
+    }
+}
+
+// must be called with the session's busy mutex held
+static bool session_make_resident(llama_llm_engine * engine, llama_llm_session * session) {
+    if (session->seq_id >= 0) {
+        return true;
+    }
+
+    const llama_seq_id seq_id = engine_acquire_seq(engine, session);
+    if (seq_id < 0) {
+        return false;
+    }
+
+    std::unique_ptr<llama_seq_state_file> file;
+    if (!session->state_path.empty()) {
+        file = llama_seq_state_open(session->state_path);
+        if (file == nullptr) {
+            fprintf(stderr, "failed to open %s, the conversation will be evaluated again\n", session->state_path.c_str());
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+        std::lock_guard<std::mutex> lock(engine->mutex);
+
+        session->seq_id = seq_id;
+        session->tokens.clear();
+
+        if (file != nullptr && file->size > 0 && llama_seq_state_set(engine->ctx, seq_id, *file)) {
+            session->tokens = file->tokens;
+        }
+        else {
+            session->n_discarded = 0;
+        }
+    }
+
+    session_remove_state(session);
+    return true;
+}
+
+// evict idle sessions, least recently used first, until the resident KV state fits the budget
+static void engine_enforce_budget(llama_llm_engine * engine, llama_llm_session * self) {
+    if (engine->session_budget == 0 || engine->session_dir.empty()) {
+        return;
+    }
+
+    while (true) {
+        std::shared_ptr<llama_llm_session> victim;
+
+        {
+            std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+            std::lock_guard<std::mutex> lock(engine->mutex);
+
+            size_t total = 0;
+            for (auto & [id, session] : engine->sessions) {
+                if (session->seq_id >= 0) {
+                    total += llama_state_seq_get_size(engine->ctx, session->seq_id);
+                }
+            }
+
+            if (total <= engine->session_budget) {
+                return;
+            }
+
+            victim = engine_lock_victim(engine, self);
+        }
+
+        if (victim == nullptr || !engine_evict(engine, victim)) {
+            return;
+        }
+    }
+}
+
+static std::shared_ptr<llama_llm_session> engine_acquire_session(llama_llm_engine * engine, int id) {
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    if (!engine->running) {
+        return nullptr;
+    }
+
+    auto it = engine->sessions.find(id);
+    if (it == engine->sessions.end()) {
+        fprintf(stderr, "unknown session %d\n", id);
+        return nullptr;
+    }
+
+    engine->n_callers++;
+    return it->second;
+}
+
+static void engine_release_session(llama_llm_engine * engine) {
+    std::lock_guard<std::mutex> lock(engine->mutex);
+    engine->n_callers--;
+    engine->cv.notify_all();
+}
+
+// length of the longest prefix of the first n bytes of text that does not end inside a UTF-8 character
+static size_t utf8_complete(const std::string & text, size_t n) {
+    for (size_t i = 1; i <= std::min<size_t>(n, 4); i++) {
+        const unsigned char c = text[n - i];
+        if ((c & 0xC0) == 0x80) {
+            continue;
+        }
+
+        const size_t len = (c & 0x80) == 0x00 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return i < len ? n - i : n;
+    }
+
+    return n;
+}
+
+static size_t common_prefix(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n]) {
+        n++;
+    }
+
+    return n;
+}
+
+// resident tokens that match the new prompt, past the sink tokens of a shifted sequence the
+// resident tokens stand for the prompt tokens n_discarded further on
+static size_t resident_prefix(const llama_llm_session * session, const std::vector<llama_token> & prompt_tokens) {
+    const auto & tokens = session->tokens;
+
+    size_t n = common_prefix(tokens, prompt_tokens);
+    if (session->n_discarded == 0) {
+        return n;
+    }
+
+    const size_t n_sink = std::min(session->n_sink, tokens.size());
+    n = std::min(n, n_sink);
+    if (n < n_sink) {
+        return n;
+    }
+
+    while (n < tokens.size() && n + session->n_discarded < prompt_tokens.size() && tokens[n] == prompt_tokens[n + session->n_discarded]) {
+        n++;
+    }
+
+    return n;
+}
+
+// reads [{"role": ..., "content": ...}, ...] into an arena as it is parsed, without building a json tree
+struct message_reader {
+    llama_arena & arena;
+    std::vector<llama_chat_message> & messages;
+    int depth = 0;
+    const char ** field = nullptr; // where the value of the current key goes
+
+    bool value() {
+        field = nullptr;
+        return depth > 0;
+    }
+
+    bool null() { return value(); }
+    bool boolean(bool) { return value(); }
+    bool number_integer(json::number_integer_t) { return value(); }
+    bool number_unsigned(json::number_unsigned_t) { return value(); }
+    bool number_float(json::number_float_t, const json::string_t &) { return value(); }
+    bool binary(json::binary_t &) { return value(); }
+
+    bool string(json::string_t & text) {
+        if (field != nullptr) {
+            *field = arena.strdup(text.data(), text.size());
+        }
+
+        return value();
+    }
+
+    bool start_object(size_t) {
+        if (depth == 0) {
+            fprintf(stderr, "the messages have to be a json array\n");
+            return false;
+        }
+
+        if (++depth == 2) {
+            messages.push_back({nullptr, nullptr});
+        }
+
+        field = nullptr;
+        return true;
+    }
+
+    bool key(json::string_t & key) {
+        field = nullptr;
+
+        if (depth == 2 && key == "role") {
+            field = &messages.back().role;
+        }
+        else if (depth == 2 && key == "content") {
+            field = &messages.back().content;
+        }
+
+        return true;
+    }
+
+    bool end_object() {
+        depth--;
+        return true;
+    }
+
+    bool start_array(size_t) {
+        field = nullptr;
+        depth++;
+        return true;
+    }
+
+    bool end_array() {
+        depth--;
+        return true;
+    }
+
+    bool parse_error(size_t position, const std::string &, const json::exception & e) {
+        fprintf(stderr, "failed to parse the messages at %zu: %s\n", position, e.what());
+        return false;
+    }
+};
+
+// must be called with the session's busy mutex held, the messages stay valid until the next request
+static bool session_parse(llama_llm_engine * engine, llama_llm_session * session, const char * text) {
+    session->allocations_start = engine->n_allocations.load();
+
+    auto & messages = session->messages;
+    growth_counter messages_grown(engine->n_allocations, messages);
+
+    session->arena.reset();
+    messages.clear();
+
+    message_reader reader = {session->arena, messages};
+    if (!json::sax_parse(text, &reader)) {
+        return false;
+    }
+
+    for (auto & message : messages) {
+        if (message.role == nullptr || message.content == nullptr) {
+            fprintf(stderr, "every message needs a role and a content string\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// shorter segments are tokenized faster than they are looked up
+static const size_t token_cache_min_length = 256;
+
+// appends the tokens of a rendered segment, taken from the token cache if it was tokenized before
+static void tokenize_segment(llama_llm_engine * engine, llama_llm_session * session, const char * text, size_t length, bool add_special, std::vector<llama_token> & tokens) {
+    auto vocab = llama_model_get_vocab(engine->model);
+
+    if (engine->token_cache.capacity == 0 || length < token_cache_min_length) {
+        tokenize_append(vocab, text, length, add_special, tokens);
+        return;
+    }
+
+    const uint64_t key = fnv1a_hash(text, length, fnv1a_hash(&add_special, sizeof(add_special)));
+    const size_t n_before = tokens.size();
+
+    if (engine->token_cache.get(key, text, length, add_special, tokens)) {
+        session->n_tokens_cached += tokens.size() - n_before;
+        return;
+    }
+
+    tokenize_append(vocab, text, length, add_special, tokens);
+
+    if (engine->token_cache.put(key, text, length, add_special, tokens.data() + n_before, tokens.size() - n_before)) {
+        engine->n_allocations++;
+    }
+}
+
+// number of prompt tokens covered by the leading system messages, these are what the prefix cache stores
+static size_t prefix_length(llama_llm_engine * engine, llama_llm_session * session, const char * tmpl, const std::vector<llama_chat_message> & messages, const std::vector<llama_token> & prompt_tokens) {
+    size_t n_system = 0;
+    while (n_system < messages.size() && strcmp(messages[n_system].role, "system") == 0) {
+        n_system++;
+    }
+
+    if (n_system == 0) {
+        return 0;
+    }
+
+    growth_counter rendered_grown(engine->n_allocations, session->rendered);
+    growth_counter tokens_grown(engine->n_allocations, session->prefix_tokens);
+
+    const int len = render(tmpl, messages.data(), n_system, false, session->rendered);
+    if (len <= 0) {
+        return 0;
+    }
+
+    session->prefix_tokens.clear();
+    tokenize_segment(engine, session, session->rendered.data(), len, true, session->prefix_tokens);
+
+    const size_t n_prefix = common_prefix(session->prefix_tokens, prompt_tokens);
+
+    // something has to follow the prefix for a reply to be generated
+    return n_prefix < prompt_tokens.size() ? n_prefix : 0;
+}
+
+static uint64_t message_hash(const llama_chat_message & message) {
+    return fnv1a_hash(message.content, strlen(message.content), fnv1a_hash(message.role, strlen(message.role) + 1));
+}
+
+// renders messages and appends their tokens
+static bool render_append(llama_llm_engine * engine, llama_llm_session * session, const llama_chat_message * messages, size_t n_messages, bool add_ass, bool add_special, std::vector<llama_token> & tokens) {
+    const char * tmpl = llama_model_chat_template(engine->model, nullptr);
+
+    const int length = render(tmpl, messages, n_messages, add_ass, session->formatted);
+    if (length < 0) {
+        return false;
+    }
+
+    tokenize_segment(engine, session, session->formatted.data(), length, add_special, tokens);
+    return true;
+}
+
+// must be called with the session's busy mutex held: renders messages into prompt_tokens and sets n_system
+// to the tokens of the leading system messages, if need_system. A template that renders every message on
+// its own only renders what follows the messages that are unchanged since an earlier request.
+static bool session_render(llama_llm_engine * engine, llama_llm_session * session, const std::vector<llama_chat_message> & messages, bool need_system, size_t & n_system) {
+    auto & prompt_tokens = session->prompt_tokens;
+    auto & chat_hashes = session->chat_hashes;
+    auto & chat_tokens = session->chat_tokens;
+    auto & checkpoints = session->chat_checkpoints;
+
+    growth_counter formatted_grown(engine->n_allocations, session->formatted);
+    growth_counter tokens_grown(engine->n_allocations, prompt_tokens);
+    growth_counter hashes_grown(engine->n_allocations, chat_hashes);
+    growth_counter chat_grown(engine->n_allocations, chat_tokens);
+    growth_counter checkpoints_grown(engine->n_allocations, checkpoints);
+
+    const char * tmpl = llama_model_chat_template(engine->model, nullptr);
+    n_system = 0;
+    session->n_tokens_cached = 0;
+
+    if (!engine->chat_incremental || messages.empty()) {
+        const int length = render(tmpl, messages.data(), messages.size(), true, session->formatted);
+        if (length < 0) {
+            return false;
+        }
+
+        prompt_tokens.clear();
+        tokenize_segment(engine, session, session->formatted.data(), length, true, prompt_tokens);
+        session->n_rendered = messages.size();
+
+        if (need_system) {
+            n_system = prefix_length(engine, session, tmpl, messages, prompt_tokens);
+        }
+
+        return true;
+    }
+
+    size_t n_same = 0;
+    while (n_same < messages.size() && n_same < chat_hashes.size() && chat_hashes[n_same] == message_hash(messages[n_same])) {
+        n_same++;
+    }
+
+    // continue from the last render that ended before the first changed message, with something left to render
+    while (!checkpoints.empty() && (checkpoints.back().first > n_same || checkpoints.back().first >= messages.size())) {
+        checkpoints.pop_back();
+    }
+
+    size_t n_done = checkpoints.empty() ? 0 : checkpoints.back().first;
+    chat_tokens.resize(checkpoints.empty() ? 0 : checkpoints.back().second);
+    chat_hashes.resize(n_done);
+
+    size_t n_system_messages = 0;
+    while (n_system_messages < messages.size() && strcmp(messages[n_system_messages].role, "system") == 0) {
+        n_system_messages++;
+    }
+
+    const size_t n_reused = n_done;
+    bool ok = true;
+
+    // the system messages are rendered apart the first time, so their tokens are known from then on
+    if (n_done == 0 && n_system_messages > 0 && n_system_messages < messages.size()) {
+        ok = render_append(engine, session, messages.data(), n_system_messages, false, true, chat_tokens);
+        n_done = n_system_messages;
+        checkpoints.push_back({n_done, chat_tokens.size()});
+    }
+
+    // and so are the messages before the last one, a regenerated or edited reply starts from there
+    const size_t n_last = messages.size() - 1;
+    if (ok && n_done < n_last) {
+        ok = render_append(engine, session, messages.data() + n_done, n_last - n_done, false, n_done == 0, chat_tokens);
+        n_done = n_last;
+        checkpoints.push_back({n_done, chat_tokens.size()});
+    }
+
+    // the generation prompt only goes into the prompt, the chat keeps the last message alone
+    prompt_tokens.assign(chat_tokens.begin(), chat_tokens.end());
+    ok = ok && render_append(engine, session, messages.data() + n_last, 1, true, n_last == 0, prompt_tokens);
+    ok = ok && render_append(engine, session, messages.data() + n_last, 1, false, n_last == 0, chat_tokens);
+
+    if (!ok) {
+        chat_hashes.clear();
+        chat_tokens.clear();
+        checkpoints.clear();
+        return false;
+    }
+
+    checkpoints.push_back({messages.size(), chat_tokens.size()});
+    for (size_t i = chat_hashes.size(); i < messages.size(); i++) {
+        chat_hashes.push_back(message_hash(messages[i]));
+    }
+
+    session->n_rendered = messages.size() - n_reused;
+
+    if (need_system && n_system_messages > 0) {
+        auto it = std::find_if(checkpoints.begin(), checkpoints.end(), [&](const std::pair<size_t, size_t> & checkpoint) {
+            return checkpoint.first == n_system_messages;
+        });
+
+        if (it != checkpoints.end()) {
+            // something has to follow the prefix for a reply to be generated
+            n_system = it->second < prompt_tokens.size() ? it->second : 0;
+        }
+        else {
+            n_system = prefix_length(engine, session, tmpl, messages, prompt_tokens);
+        }
+    }
+
+    return true;
+}
+
+static std::string prefix_cache_path(llama_llm_engine * engine, const std::vector<llama_token> & tokens, size_t n_prefix) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.state", (unsigned long long) fnv1a_hash(tokens.data(), n_prefix * sizeof(llama_token), engine->cache_key));
+
+    return (std::filesystem::u8path(engine->cache_dir) / name).u8string();
+}
+
+// must be called with the session's busy mutex held
+static int session_start(llama_llm_engine * engine, llama_llm_session * session, std::vector<llama_chat_message> & messages) {
+    if (session->freed) {
+        return 1;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+
+        if (session->active) {
+            fprintf(stderr, "session %d is still replying\n", session->id);
+            return 1;
+        }
+
+        session->last_used = ++engine->tick;
+    }
+
+    if (!session_make_resident(engine, session)) {
+        return 1;
+    }
+
+    auto & prompt_tokens = session->prompt_tokens;
+
+    growth_counter prompt_grown(engine->n_allocations, session->prompt);
+
+    // the system prompt is what the prefix cache stores and, by default, what a context shift keeps
+    const bool need_system = !engine->cache_dir.empty() || (engine->context_shift && engine->n_keep < 0);
+    size_t n_system = 0;
+
+    if (!session_render(engine, session, messages, need_system, n_system)) {
+        fprintf(stderr, "failed to apply the chat template\n");
+        return 1;
+    }
+
+    if (prompt_tokens.empty()) {
+        fprintf(stderr, "nothing to evaluate in the prompt\n");
+        return 1;
+    }
+
+    // a system prompt that is not resident may have been saved to disk by an earlier run
+    size_t n_prefix = engine->cache_dir.empty() ? 0 : n_system;
+    std::string prefix_path;
+    std::unique_ptr<llama_seq_state_file> prefix_file;
+
+    if (n_prefix > 0 && common_prefix(session->tokens, prompt_tokens) < n_prefix) {
+        prefix_path = prefix_cache_path(engine, prompt_tokens, n_prefix);
+        prefix_file = llama_seq_state_open(prefix_path);
+
+        if (prefix_file && !std::equal(prefix_file->tokens.begin(), prefix_file->tokens.end(), prompt_tokens.begin(), prompt_tokens.begin() + n_prefix)) {
+            prefix_file.reset();
+        }
+    }
+    else {
+        n_prefix = 0;
+    }
+
+    {
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+        std::lock_guard<std::mutex> lock(engine->mutex);
+
+        auto & tokens = session->tokens;
+
+        if (prefix_file) {
+            if (llama_seq_state_set(engine->ctx, session->seq_id, *prefix_file)) {
+                tokens = prefix_file->tokens;
+                n_prefix = 0;
+            }
+            else {
+                fprintf(stderr, "failed to restore %s\n", prefix_path.c_str());
+                tokens.clear();
+            }
+
+            session->n_discarded = 0;
+        }
+
+        session->save_at = n_prefix;
+
+        // keep the longest common prefix of what is in the cache and the new history, this covers
+        // appended turns as well as edited, deleted and regenerated messages
+        size_t n_keep = resident_prefix(session, prompt_tokens);
+
+        // a shifted window that no longer lines up with the history is dropped, the sink tokens stay
+        if (session->n_discarded > 0 && (n_keep < session->n_sink || session->n_sink + session->n_discarded >= prompt_tokens.size())) {
+            n_keep = std::min(n_keep, session->n_sink);
+            session->n_discarded = 0;
+        }
+
+        // at least one token has to be decoded to get logits for the reply
+        if (n_keep + session->n_discarded == prompt_tokens.size()) {
+            n_keep--;
+        }
+
+        if (n_keep < tokens.size()) {
+            llama_kv_self_seq_rm(engine->ctx, session->seq_id, n_keep, -1);
+            tokens.resize(n_keep);
+        }
+
+        if (session->n_discarded == 0) {
+            const size_t n_sink = engine->n_keep >= 0 ? engine->n_keep : std::max<size_t>(n_system, 1);
+            session->n_sink = std::min<size_t>(n_sink, llama_n_ctx(engine->ctx) / llama_n_seq_max(engine->ctx) / 2);
+        }
+
+        session->prompt.assign(prompt_tokens.begin() + n_keep + session->n_discarded, prompt_tokens.end());
+        session->n_prompt_done = 0;
+        session->n_prompt = session->prompt.size();
+        session->n_reported = 0;
+        session->prefix_path = prefix_path;
+        session->prefix.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_prefix);
+        session->pending.clear();
+        session->output.discard();
+        session->pending_records.clear();
+        session->records.discard();
+        session->stop_state = 0;
+        session->stop_held.clear();
+        session->n_generated = 0;
+        session->n_steps = 0;
+        session->n_drafted = 0;
+        session->n_accepted = 0;
+        session->n_flushes = 0;
+        session->stop.store(false);
+        session->finished = false;
+        session->result = 0;
+        session->active = true;
+
+        engine->cv.notify_all();
+    }
+
+    return 0;
+}
+
+// caller side: moves the reply from the ring to pending, true if the scheduler waits for the room it made
+static bool session_drain(llama_llm_session * session, int & n_pieces) {
+    // records first, so none is left behind for a piece that was drained
+    int n_records = 0;
+    while (session->records.pop(session->pending_records)) {
+        n_records++;
+    }
+
+    n_pieces = 0;
+    while (session->output.pop(session->pending)) {
+        n_pieces++;
+    }
+
+    if (n_pieces == 0 && n_records == 0) {
+        return false;
+    }
+
+    // pairs with the fence in engine_loop, either it sees the room or this sees it blocked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return session->blocked.load();
+}
+
+// caller side: hands the logprob records drained so far to the session's callback, ahead of their text
+static void session_flush_records(llama_llm_session * session) {
+    auto & pending = session->pending_records;
+    if (pending.empty() || session->logprobs == nullptr) {
+        pending.clear();
+        return;
+    }
+
+    // the receiver may read the records after the call returns, so they go out as a heap copy
+    auto * records = (llama_token_logprob *) malloc(pending.size());
+    memcpy(records, pending.data(), pending.size());
+
+    const int n_records = pending.size() / ((1 + session->n_top) * sizeof(llama_token_logprob));
+    pending.clear();
+
+    session->logprobs(session->id, records, n_records, session->n_top);
+}
+
+// caller side, once the reply has been handed over: saves what the request captured and frees up memory
+static int session_end(llama_llm_engine * engine, llama_llm_session * session) {
+    int result = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+        session->active = false;
+        session->n_allocations = engine->n_allocations.load() - session->allocations_start;
+        result = session->result;
+    }
+
+    if (!session->saved_state.empty()) {
+        llama_seq_state_write(session->prefix_path, session->prefix, session->saved_state);
+        session->saved_state.clear();
+    }
+
+    engine_enforce_budget(engine, session);
+
+    return result;
+}
+
+// caller side: hands the reply over as it is generated, until the scheduler has finished it
+template <typename F>
+static void session_deliver(llama_llm_engine * engine, llama_llm_session * session, const F & output) {
+    // pieces are handed over in batches of whole characters to save callbacks
+    auto & pending = session->pending;
+    int n_pending = 0;
+    bool partial = false; // pending ends inside a character, wait for the rest of it
+    auto deadline = std::chrono::steady_clock::now();
+    const auto flush_ms = std::chrono::milliseconds(engine->stream_flush_ms);
+
+    std::unique_lock<std::mutex> lock(engine->mutex);
+    while (true) {
+        auto ready = [&] {
+            return !session->output.empty() || session->finished || (session->progress != nullptr && session->n_prompt_done > session->n_reported);
+        };
+
+        if (n_pending > 0 && !partial && flush_ms.count() > 0) {
+            session->cv.wait_until(lock, deadline, ready);
+        }
+        else {
+            session->cv.wait(lock, ready);
+        }
+
+        if (session->progress != nullptr && session->n_prompt_done > session->n_reported) {
+            session->n_reported = session->n_prompt_done;
+
+            lock.unlock();
+            session->progress(session->n_reported, session->n_prompt);
+            lock.lock();
+            continue;
+        }
+
+        const bool finished = session->finished;
+
+        int n_pieces = 0;
+        growth_counter pending_grown(engine->n_allocations, pending);
+        if (session_drain(session, n_pieces)) {
+            session->blocked = false;
+            engine->cv.notify_all();
+        }
+
+        if (n_pieces > 0) {
+            if (n_pending == 0) {
+                deadline = std::chrono::steady_clock::now() + flush_ms;
+            }
+
+            n_pending += n_pieces;
+            partial = false;
+        }
+
+        const bool due = finished || n_pending >= engine->stream_flush_tokens || (flush_ms.count() > 0 && std::chrono::steady_clock::now() >= deadline);
+
+        if (n_pending == 0 || !due) {
+            if (finished) {
+                break;
+            }
+            continue;
+        }
+
+        const size_t n_complete = finished ? pending.size() : utf8_complete(pending, pending.size());
+        if (n_complete == 0) {
+            partial = true;
+            continue;
+        }
+
+        auto & text = session->flushed;
+        {
+            growth_counter flushed_grown(engine->n_allocations, text);
+            text.assign(pending, 0, n_complete);
+        }
+
+        pending.erase(0, n_complete);
+        n_pending = pending.empty() ? 0 : 1;
+        partial = !pending.empty();
+        session->n_flushes++;
+
+        lock.unlock();
+        session_flush_records(session);
+        output(text.c_str());
+        lock.lock();
+    }
+
+    lock.unlock();
+    session_flush_records(session);
+}
+
+static int session_prompt(llama_llm_engine * engine, llama_llm_session * session, const char * messages, dart_output * output) {
+    std::lock_guard<std::mutex> busy(session->busy);
+
+    if (!session_parse(engine, session, messages) || session_start(engine, session, session->messages) != 0) {
+        return 1;
+    }
+
+    session_deliver(engine, session, output);
+
+    const int result = session_end(engine, session);
+
+    output(nullptr);
+    return result;
+}
+
+// caller side of a started request, see llama_engine_session_poll
+static int session_poll(llama_llm_engine * engine, llama_llm_session * session, char * buffer, int size) {
+    int n_pieces = 0;
+    const bool wake = session_drain(session, n_pieces);
+
+    bool finished = false;
+    dart_progress * progress = nullptr;
+    int n_report = -1;
+
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+
+        if (wake) {
+            session->blocked = false;
+            engine->cv.notify_all();
+        }
+
+        if (!session->active) {
+            return -1;
+        }
+
+        finished = session->finished;
+        progress = session->progress;
+
+        if (progress != nullptr && session->n_prompt_done > session->n_reported) {
+            session->n_reported = session->n_prompt_done;
+            n_report = session->n_reported;
+        }
+    }
+
+    if (n_report >= 0) {
+        progress(n_report, session->n_prompt);
+    }
+
+    // the last pieces are written before the session is marked finished
+    if (finished) {
+        session_drain(session, n_pieces);
+    }
+
+    session_flush_records(session);
+
+    if (session->pending.empty()) {
+        if (!finished) {
+            return 0;
+        }
+
+        std::lock_guard<std::mutex> busy(session->busy);
+        return session_end(engine, session) == 0 ? -1 : -2;
+    }
+
+    auto & pending = session->pending;
+
+    // the buffer holds a character of any length, so something always fits
+    size_t n = finished ? pending.size() : utf8_complete(pending, pending.size());
+    if (n >= (size_t) size) {
+        n = utf8_complete(pending, size - 1);
+    }
+
+    memcpy(buffer, pending.data(), n);
+    buffer[n] = '\0';
+    pending.erase(0, n);
+
+    return n;
+}
+
+int llama_engine_session_prompt(llama_llm_engine * engine, int id, const char * messages, dart_output * output) {
+    auto session = engine_acquire_session(engine, id);
+    if (session == nullptr) {
+        return 1;
+    }
+
+    const int result = session_prompt(engine, session.get(), messages, output);
+
+    engine_release_session(engine);
+    return result;
+}
+
+int llama_engine_session_start(llama_llm_engine * engine, int id, const char * messages) {
+    auto session = engine_acquire_session(engine, id);
+    if (session == nullptr) {
+        return 1;
+    }
+
+    int result = 0;
+
+    {
+        std::lock_guard<std::mutex> busy(session->busy);
+        result = session_parse(engine, session.get(), messages) ? session_start(engine, session.get(), session->messages) : 1;
+    }
+
+    engine_release_session(engine);
+    return result;
+}
+
+// a started request owns the session until its reply has been polled to the end
+static bool session_replying(llama_llm_engine * engine, llama_llm_session * session) {
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    if (session->active) {
+        fprintf(stderr, "session %d is still replying\n", session->id);
+    }
+
+    return session->active;
+}
+
+// messages is null to reply to the session's history, the reply is then appended to it
+static int session_submit(llama_llm_engine * engine, int id, const char * messages, dart_response * response) {
+    auto session = engine_acquire_session(engine, id);
+    if (session == nullptr) {
+        return -1;
+    }
+
+    {
+        std::lock_guard<std::mutex> busy(session->busy);
+
+        bool parsed = true;
+
+        if (messages != nullptr) {
+            parsed = session_parse(engine, session.get(), messages);
+        }
+        else {
+            session->allocations_start = engine->n_allocations.load();
+
+            growth_counter messages_grown(engine->n_allocations, session->messages);
+
+            session->messages.clear();
+            for (auto & message : session->history) {
+                session->messages.push_back({ message.first.c_str(), message.second.c_str() });
+            }
+        }
+
+        if (!parsed || session_start(engine, session.get(), session->messages) != 0) {
+            engine_release_session(engine);
+            return -1;
+        }
+    }
+
+    int request = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+        request = ++engine->next_request;
+        engine->requests[request] = id;
+    }
+
+    const bool append = messages == nullptr;
+    std::vector<std::thread> joinable;
+
+    std::unique_lock<std::mutex> engine_lock(engine->mutex);
+
+    // threads of replies handed over before are joined here rather than left to run past the engine
+    for (int done : engine->delivered) {
+        auto it = engine->deliveries.find(done);
+        joinable.push_back(std::move(it->second));
+        engine->deliveries.erase(it);
+    }
+    engine->delivered.clear();
+
+    // the reply is handed over from a thread the engine owns, the caller only hears back through response,
+    // which gets its own copy of every piece since a listener may run after this returns. It reports
+    // done under the lock held here, so it is registered before it can be joined
+    engine->deliveries[request] = std::thread([engine, session, request, response, append]() mutable {
+        std::string reply;
+
+        session_deliver(engine, session.get(), [&](const char * text) {
+            if (append) {
+                growth_counter reply_grown(engine->n_allocations, reply);
+                reply += text;
+            }
+
+            engine->n_allocations++;
+            response(request, strdup(text), 0);
+        });
+
+        int result = 0;
+
+        {
+            std::lock_guard<std::mutex> busy(session->busy);
+            result = session_end(engine, session.get());
+
+            if (append && result == 0) {
+                session->history.emplace_back("assistant", std::move(reply));
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(engine->mutex);
+            engine->requests.erase(request);
+        }
+
+        response(request, nullptr, result);
+
+        // the session and its samplers go before the engine may free the model
+        session.reset();
+
+        {
+            std::lock_guard<std::mutex> lock(engine->mutex);
+            engine->delivered.push_back(request);
+        }
+
+        engine_release_session(engine);
+    });
+
+    engine_lock.unlock();
+
+    for (auto & thread : joinable) {
+        thread.join();
+    }
+
+    return request;
+}
+
+int llama_engine_session_submit(llama_llm_engine * engine, int id, const char * messages, dart_response * response) {
+    return session_submit(engine, id, messages, response);
+}
+
+int llama_engine_session_submit_history(llama_llm_engine * engine, int id, dart_response * response) {
+    return session_submit(engine, id, nullptr, response);
+}
+
+int llama_engine_session_append(llama_llm_engine * engine, int id, const char * role, const char * content) {
+    auto session = engine_acquire_session(engine, id);
+    if (session == nullptr) {
+        return 1;
+    }
+
+    int result = 1;
+
+    {
+        std::lock_guard<std::mutex> busy(session->busy);
+
+        if (!session->freed && !session_replying(engine, session.get())) {
+            session->history.emplace_back(role, content);
+            result = 0;
+        }
+    }
+
+    engine_release_session(engine);
+    return result;
+}
+
+int llama_engine_session_truncate(llama_llm_engine * engine, int id, int n_messages) {
+    auto session = engine_acquire_session(engine, id);
+    if (session == nullptr) {
+        return 1;
+    }
+
+    int result = 1;
+
+    {
+        std::lock_guard<std::mutex> busy(session->busy);
+
+        if (!session->freed && !session_replying(engine, session.get())) {
+            if (n_messages >= 0 && (size_t) n_messages < session->history.size()) {
+                session->history.resize(n_messages);
+            }
+
+            result = 0;
+        }
+    }
+
+    engine_release_session(engine);
+    return result;
+}
+
+void llama_engine_request_cancel(llama_llm_engine * engine, int request) {
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    auto it = engine->requests.find(request);
+    if (it == engine->requests.end()) {
+        return;
+    }
+
+    auto session = engine->sessions.find(it->second);
+    if (session != engine->sessions.end()) {
+        session->second->stop.store(true);
+    }
+}
+
+int llama_engine_session_poll(llama_llm_engine * engine, int id, char * buffer, int size) {
+    if (buffer == nullptr || size < LLAMA_POLL_MIN_SIZE) {
+        fprintf(stderr, "the poll buffer needs at least %d bytes\n", LLAMA_POLL_MIN_SIZE);
+        return -2;
+    }
+
+    auto session = engine_acquire_session(engine, id);
+    if (session == nullptr) {
+        return -2;
+    }
+
+    const int result = session_poll(engine, session.get(), buffer, size);
+
+    engine_release_session(engine);
+    return result;
+}
+
+void llama_engine_session_set_progress(llama_llm_engine * engine, int id, dart_progress * progress) {
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    auto it = engine->sessions.find(id);
+    if (it != engine->sessions.end()) {
+        it->second->progress = progress;
+    }
+}
+
+int llama_engine_session_set_logprobs(llama_llm_engine * engine, int id, int n_top, dart_logprobs * logprobs) {
+    if (n_top < 0 || n_top > LLAMA_LOGPROBS_MAX) {
+        fprintf(stderr, "n_top must be between 0 and %d\n", LLAMA_LOGPROBS_MAX);
+        return 1;
+    }
+
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    auto it = engine->sessions.find(id);
+    if (it == engine->sessions.end()) {
+        fprintf(stderr, "unknown session %d\n", id);
+        return 1;
+    }
+
+    auto & session = it->second;
+
+    // the record size is fixed for a request, and the ring is only set up between requests
+    if (session->active) {
+        fprintf(stderr, "session %d is replying\n", id);
+        return 1;
+    }
+
+    session->logprobs = logprobs;
+    session->n_top = n_top;
+
+    if (logprobs != nullptr && session->records.capacity() < 2 * (std::max(engine->n_draft, 0) + 1) * session_record_size(session.get())) {
+        session->records.init(std::max<size_t>(engine->output_size, 2 * (std::max(engine->n_draft, 0) + 1) * session_record_size(session.get())));
+    }
+
+    return 0;
+}
+
+int llama_engine_session_set_sampler(llama_llm_engine * engine, int id, const char * params) {
+    const std::string text = params != nullptr ? params : "";
+
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+
+        auto it = engine->sessions.find(id);
+        if (it == engine->sessions.end()) {
+            fprintf(stderr, "unknown session %d\n", id);
+            return 1;
+        }
+
+        // the chain keeps its state across requests, as it would without a change
+        if (it->second->sampler_params == text) {
+            return 0;
+        }
+    }
+
+    // built or cloned outside the lock, a grammar can take a while to parse
+    llama_sampler * grammar = nullptr;
+    std::shared_ptr<const llama_stop_automaton> stop_strings;
+    llama_sampler * smpl = engine->samplers.clone(engine->model, engine->params, text, &grammar, &stop_strings);
+    if (smpl == nullptr) {
+        return 1;
+    }
+
+    if (!stop_strings_fit(engine, stop_strings.get())) {
+        llama_sampler_free(smpl);
+        if (grammar != nullptr) {
+            llama_sampler_free(grammar);
+        }
+        return 1;
+    }
+
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    auto it = engine->sessions.find(id);
+    if (it == engine->sessions.end() || it->second->active) {
+        fprintf(stderr, "session %d is gone or replying\n", id);
+        llama_sampler_free(smpl);
+        if (grammar != nullptr) {
+            llama_sampler_free(grammar);
+        }
+        return 1;
+    }
+
+    // the scheduler only samples for active sessions, so the chain can be swapped under mutex alone
+    std::swap(it->second->smpl, smpl);
+    std::swap(it->second->grammar, grammar);
+    it->second->stop_strings = std::move(stop_strings);
+    it->second->sampler_params = text;
+
+    llama_sampler_free(smpl);
+    if (grammar != nullptr) {
+        llama_sampler_free(grammar);
+    }
+
+    return 0;
+}
+
+json llama_engine_session_stats(llama_llm_engine * engine, int id) {
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    auto it = engine->sessions.find(id);
+    if (it == engine->sessions.end()) {
+        return json::object();
+    }
+
+    auto & session = it->second;
+
+    json stats = json::object();
+    stats["n_generated"] = session->n_generated;
+    stats["n_steps"] = session->n_steps;
+    stats["n_drafted"] = session->n_drafted;
+    stats["n_accepted"] = session->n_accepted;
+    stats["acceptance_rate"] = session->n_drafted > 0 ? (double) session->n_accepted / session->n_drafted : 0.0;
+    stats["tokens_per_step"] = session->n_steps > 0 ? (double) session->n_generated / session->n_steps : 0.0;
+    stats["n_flushes"] = session->n_flushes;
+    stats["tokens_per_flush"] = session->n_flushes > 0 ? (double) session->n_generated / session->n_flushes : 0.0;
+    stats["stream_flush_tokens"] = engine->stream_flush_tokens;
+    stats["stream_flush_ms"] = engine->stream_flush_ms;
+    stats["n_allocations"] = session->n_allocations;
+    stats["n_rendered"] = session->n_rendered.load();
+    stats["n_tokens_cached"] = session->n_tokens_cached.load();
+
+    return stats;
+}
+
+void llama_engine_session_stop(llama_llm_engine * engine, int id) {
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    auto it = engine->sessions.find(id);
+    if (it != engine->sessions.end()) {
+        it->second->stop.store(true);
+    }
+}
+
+void llama_engine_stop_all(llama_llm_engine * engine) {
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    for (auto & [id, session] : engine->sessions) {
+        session->stop.store(true);
+    }
+
+    engine->n_stops++;
+}
+
+int llama_engine_session_free(llama_llm_engine * engine, int id) {
+    auto session = engine_acquire_session(engine, id);
+    if (session == nullptr) {
+        return 1;
+    }
+
+    // interrupt a running prompt and wait for it to hand the session back
+    session->stop.store(true);
+
+    {
+        std::lock_guard<std::mutex> busy(session->busy);
+        session->freed = true;
+    }
+
+    // a submitted or started reply is still scheduled, the scheduler has to finish it before it is erased
+    {
+        std::unique_lock<std::mutex> lock(engine->mutex);
+        session->blocked = false;
+        engine->cv.notify_all();
+        session->cv.wait(lock, [&] { return !session->active || session->finished; });
+    }
+
+    {
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+        std::lock_guard<std::mutex> lock(engine->mutex);
+
+        if (session->seq_id >= 0) {
+            llama_kv_self_seq_rm(engine->ctx, session->seq_id, -1, -1);
+            engine->seq_used[session->seq_id] = false;
+        }
+
+        engine->sessions.erase(id);
+    }
+
+    session_remove_state(session.get());
+
+    engine_release_session(engine);
+    return 0;
+}
+
+int llama_engine_session_suspend(llama_llm_engine * engine, int id, const std::string & path) {
+    if (path.empty() && engine->session_dir.empty()) {
+        fprintf(stderr, "no path given and no session_dir configured\n");
+        return 1;
+    }
+
+    auto session = engine_acquire_session(engine, id);
+    if (session == nullptr) {
+        return 1;
+    }
+
+    int result = 1;
+
+    {
+        std::lock_guard<std::mutex> busy(session->busy);
+
+        if (!session->freed && !session_replying(engine, session.get())) {
+            const bool owned = path.empty();
+            result = session_suspend(engine, session.get(), owned ? session_file_path(engine, id) : path, owned) ? 0 : 1;
+        }
+    }
+
+    engine_release_session(engine);
+    return result;
+}
+
+int llama_engine_session_resume(llama_llm_engine * engine, int id, const std::string & path) {
+    auto session = engine_acquire_session(engine, id);
+    if (session == nullptr) {
+        return 1;
+    }
+
+    int result = 1;
+
+    {
+        std::lock_guard<std::mutex> busy(session->busy);
+
+        if (!session->freed && !session_replying(engine, session.get())) {
+            // load a conversation saved earlier, replacing whatever the session holds
+            if (!path.empty()) {
+                std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+                std::lock_guard<std::mutex> lock(engine->mutex);
+
+                if (session->seq_id >= 0) {
+                    llama_kv_self_seq_rm(engine->ctx, session->seq_id, -1, -1);
+                    engine->seq_used[session->seq_id] = false;
+                    session->seq_id = -1;
+                    session->tokens.clear();
+                }
+
+                session_remove_state(session.get());
+                session->state_path = path;
+                session->n_discarded = 0;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(engine->mutex);
+                session->last_used = ++engine->tick;
+            }
+
+            result = session_make_resident(engine, session.get()) ? 0 : 1;
+        }
+    }
+
+    engine_release_session(engine);
+    return result;
+}
+
+// borrows the free sequences to embed with, they are marked used so no session takes them meanwhile
+// takes up to n_max free sequences, the rest stay with the sessions
+static void engine_borrow_seqs(llama_llm_engine * engine, std::vector<llama_seq_id> & seqs, int n_max) {
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    seqs.clear();
+    for (size_t i = 0; i < engine->seq_used.size() && (int) seqs.size() < n_max; i++) {
+        if (!engine->seq_used[i]) {
+            engine->seq_used[i] = true;
+            seqs.push_back(i);
+        }
+    }
+}
+
+static void engine_return_seqs(llama_llm_engine * engine, const std::vector<llama_seq_id> & seqs) {
+    std::lock_guard<std::mutex> lock(engine->mutex);
+
+    for (auto seq_id : seqs) {
+        engine->seq_used[seq_id] = false;
+    }
+
+    engine->cv.notify_all();
+}
+
+// decodes each list of tokens on a sequence of its own, packed into as few batches as the free
+// sequences and n_ubatch allow, and hands output(k, seq_id, first) the outputs of list k while
+// they are valid, first being the batch index of its first token
+template <typename F>
+static int engine_encode(llama_llm_engine * engine, const std::vector<llama_token> & tokens, const std::vector<size_t> & offsets, F output) {
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+
+        if (!engine->running) {
+            return 1;
+        }
+
+        engine->n_callers++;
+    }
+
+    const int n_lists = offsets.size() - 1;
+    const int n_ubatch = llama_n_ubatch(engine->ctx);
+    const bool encode = llama_model_has_encoder(engine->model) && !llama_model_has_decoder(engine->model);
+
+    std::vector<llama_seq_id> seqs;
+    int result = 0;
+
+    for (int i = 0; i < n_lists && result == 0;) {
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+
+        engine_borrow_seqs(engine, seqs, n_lists - i);
+        if (seqs.empty()) {
+            fprintf(stderr, "no free sequence to encode with, raise n_seq_max\n");
+            result = 1;
+            break;
+        }
+
+        auto & batch = engine->batch;
+        batch.n_tokens = 0;
+
+        const int first = i;
+        std::vector<int32_t> starts;
+
+        while (i < n_lists && i - first < (int) seqs.size()) {
+            const int n_tokens = offsets[i + 1] - offsets[i];
+            if (batch.n_tokens > 0 && batch.n_tokens + n_tokens > n_ubatch) {
+                break;
+            }
+
+            starts.push_back(batch.n_tokens);
+            for (int j = 0; j < n_tokens; j++) {
+                batch_add(batch, tokens[offsets[i] + j], j, seqs[i - first], true);
+            }
+
+            i++;
+        }
+
+        // the abort callback only concerns the sessions of the scheduler's own steps
+        engine->scheduled.clear();
+
+        llama_set_embeddings(engine->ctx, true);
+
+        if (batch.n_tokens > 0 && (encode ? llama_encode(engine->ctx, batch) : llama_decode(engine->ctx, batch)) != 0) {
+            fprintf(stderr, "failed to encode the batch\n");
+            result = 1;
+        }
+
+        for (int k = first; k < i && result == 0; k++) {
+            result = output(k, seqs[k - first], starts[k - first]);
+        }
+
+        for (auto seq_id : seqs) {
+            llama_kv_self_seq_rm(engine->ctx, seq_id, -1, -1);
+        }
+
+        llama_set_embeddings(engine->ctx, engine->embeddings);
+
+        engine_return_seqs(engine, seqs);
+    }
+
+    engine_release_session(engine);
+    return result;
+}
+
+int llama_engine_embed(llama_llm_engine * engine, const char * const * texts, int n_texts, float * embeddings, bool normalize) {
+    const enum llama_pooling_type pooling = llama_pooling_type(engine->ctx);
+    if (pooling == LLAMA_POOLING_TYPE_RANK) {
+        fprintf(stderr, "a reranking context has no embeddings\n");
+        return 1;
+    }
+
+    auto vocab = llama_model_get_vocab(engine->model);
+    const int n_embd = llama_model_n_embd(engine->model);
+    const int n_ubatch = llama_n_ubatch(engine->ctx);
+
+    // without pooling in the context, the embeddings of the tokens are averaged here
+    const bool pooled = pooling != LLAMA_POOLING_TYPE_NONE && pooling != LLAMA_POOLING_TYPE_UNSPECIFIED;
+
+    // texts are tokenized up front, outside of ctx_mutex
+    std::vector<llama_token> tokens;
+    std::vector<size_t> offsets = {0};
+
+    for (int i = 0; i < n_texts; i++) {
+        tokenize_append(vocab, texts[i], strlen(texts[i]), true, tokens);
+
+        // a sequence has to fit a single ubatch to be pooled as a whole
+        if (tokens.size() - offsets.back() > (size_t) n_ubatch) {
+            fprintf(stderr, "text %d is longer than n_ubatch (%d) and was truncated\n", i, n_ubatch);
+            tokens.resize(offsets.back() + n_ubatch);
+        }
+
+        offsets.push_back(tokens.size());
+    }
+
+    return engine_encode(engine, tokens, offsets, [&](int k, llama_seq_id seq_id, int32_t first) {
+        float * out = embeddings + (size_t) k * n_embd;
+        const int n_tokens = offsets[k + 1] - offsets[k];
+
+        std::fill(out, out + n_embd, 0.0f);
+
+        if (n_tokens == 0) {
+            return 0;
+        }
+
+        if (pooled) {
+            const float * embd = llama_get_embeddings_seq(engine->ctx, seq_id);
+            if (embd == nullptr) {
+                fprintf(stderr, "no embeddings for text %d\n", k);
+                return 1;
+            }
+
+            std::copy(embd, embd + n_embd, out);
+        }
+        else {
+            for (int j = 0; j < n_tokens; j++) {
+                const float * embd = llama_get_embeddings_ith(engine->ctx, first + j);
+                for (int d = 0; d < n_embd; d++) {
+                    out[d] += embd[d] / n_tokens;
+                }
+            }
+        }
+
+        if (normalize) {
+            double sum = 0.0;
+            for (int d = 0; d < n_embd; d++) {
+                sum += (double) out[d] * out[d];
+            }
+
+            const float scale = sum > 0.0 ? 1.0 / std::sqrt(sum) : 0.0f;
+            for (int d = 0; d < n_embd; d++) {
+                out[d] *= scale;
+            }
+        }
+
+        return 0;
+    });
+}
+
+int llama_engine_rerank(llama_llm_engine * engine, const char * query, const char * const * passages, int n_passages, float * scores) {
+    if (llama_pooling_type(engine->ctx) != LLAMA_POOLING_TYPE_RANK) {
+        fprintf(stderr, "reranking needs a context with the rank pooling type\n");
+        return 1;
+    }
+
+    auto vocab = llama_model_get_vocab(engine->model);
+    const int n_ubatch = llama_n_ubatch(engine->ctx);
+
+    // the query is tokenized once and repeated in every pair
+    std::vector<llama_token> query_tokens;
+    tokenize_append(vocab, query, strlen(query), false, query_tokens);
+
+    // a pair reads [BOS] query [EOS] [SEP] passage [EOS], as the reranker was trained on
+    auto add_special = [](std::vector<llama_token> & tokens, llama_token token) {
+        if (token != LLAMA_TOKEN_NULL) {
+            tokens.push_back(token);
+        }
+    };
+
+    std::vector<llama_token> tokens;
+    std::vector<size_t> offsets = {0};
+
+    for (int i = 0; i < n_passages; i++) {
+        add_special(tokens, llama_vocab_bos(vocab));
+        tokens.insert(tokens.end(), query_tokens.begin(), query_tokens.end());
+        add_special(tokens, llama_vocab_eos(vocab));
+        add_special(tokens, llama_vocab_sep(vocab));
+
+        tokenize_append(vocab, passages[i], strlen(passages[i]), false, tokens);
+
+        // the passage is cut so the whole pair fits a single ubatch
+        if (tokens.size() - offsets.back() + 1 > (size_t) n_ubatch) {
+            fprintf(stderr, "passage %d does not fit n_ubatch (%d) and was truncated\n", i, n_ubatch);
+            tokens.resize(offsets.back() + std::max(n_ubatch - 1, 0));
+        }
+
+        add_special(tokens, llama_vocab_eos(vocab));
+
+        offsets.push_back(tokens.size());
+    }
+
+    return engine_encode(engine, tokens, offsets, [&](int k, llama_seq_id seq_id, int32_t) {
+        const float * score = llama_get_embeddings_seq(engine->ctx, seq_id);
+        if (score == nullptr) {
+            fprintf(stderr, "no score for passage %d\n", k);
+            return 1;
+        }
+
+        scores[k] = score[0];
+        return 0;
+    });
+}
+
+// log-probability of token under the logits of one output
+static float token_logprob(const float * logits, int n_vocab, llama_token token) {
+    const float max = *std::max_element(logits, logits + n_vocab);
+
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; i++) {
+        sum += std::exp(logits[i] - max);
+    }
+
+    return logits[token] - max - std::log(sum);
+}
+
+int llama_engine_loglikelihood(llama_llm_engine * engine, const char * prompt, const char * const * candidates, int n_candidates, float * logprobs) {
+    auto vocab = llama_model_get_vocab(engine->model);
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    const int n_batch = llama_n_batch(engine->ctx);
+
+    // the candidates are tokenized on their own, so a candidate starts on a token boundary
+    std::vector<llama_token> prompt_tokens;
+    tokenize_append(vocab, prompt, strlen(prompt), true, prompt_tokens);
+
+    std::vector<llama_token> tokens;
+    std::vector<size_t> offsets = {0};
+
+    for (int i = 0; i < n_candidates; i++) {
+        tokenize_append(vocab, candidates[i], strlen(candidates[i]), false, tokens);
+        offsets.push_back(tokens.size());
+
+        if (offsets[i + 1] - offsets[i] > (size_t) n_batch) {
+            fprintf(stderr, "candidate %d is longer than n_batch (%d)\n", i, n_batch);
+            return 1;
+        }
+    }
+
+    if (prompt_tokens.empty()) {
+        fprintf(stderr, "the prompt has no tokens to condition on\n");
+        return 1;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+
+        if (!engine->running) {
+            return 1;
+        }
+
+        engine->n_callers++;
+    }
+
+    // the sequences are held for the whole call, the decodes in between leave ctx_mutex to the scheduler,
+    // one per candidate is enough and the prompt is decoded on the first of them
+    std::vector<llama_seq_id> seqs;
+    engine_borrow_seqs(engine, seqs, std::max(n_candidates, 1));
+
+    const llama_pos n_prompt = prompt_tokens.size();
+    auto & batch = engine->batch;
+    std::vector<float> prompt_logits;
+    int result = 0;
+
+    if (seqs.empty()) {
+        fprintf(stderr, "no free sequence to score with, raise n_seq_max\n");
+        result = 1;
+    }
+
+    // the prompt is decoded once, only the logits of its last token are kept
+    for (llama_pos i = 0; i < n_prompt && result == 0; i += n_batch) {
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+
+        batch.n_tokens = 0;
+        for (llama_pos j = i; j < std::min<llama_pos>(n_prompt, i + n_batch); j++) {
+            batch_add(batch, prompt_tokens[j], j, seqs[0], j == n_prompt - 1);
+        }
+
+        engine->scheduled.clear();
+
+        if (llama_decode(engine->ctx, batch) != 0) {
+            fprintf(stderr, "failed to decode the prompt\n");
+            result = 1;
+        }
+        else if (i + n_batch >= n_prompt) {
+            const float * logits = llama_get_logits_ith(engine->ctx, batch.n_tokens - 1);
+            prompt_logits.assign(logits, logits + n_vocab);
+        }
+    }
+
+    // every candidate continues a copy of the prompt, as many at once as there are sequences and fit a batch
+    std::vector<int32_t> starts;
+    for (int i = 0; i < n_candidates && result == 0;) {
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+
+        batch.n_tokens = 0;
+        starts.clear();
+
+        const int first = i;
+        while (i < n_candidates && i - first < (int) seqs.size()) {
+            const int n_tokens = offsets[i + 1] - offsets[i];
+            if (batch.n_tokens + n_tokens > n_batch) {
+                break;
+            }
+
+            const llama_seq_id seq_id = seqs[i - first];
+            if (seq_id != seqs[0]) {
+                llama_kv_self_seq_cp(engine->ctx, seqs[0], seq_id, 0, n_prompt);
+            }
+
+            // the last token predicts nothing that is scored
+            starts.push_back(batch.n_tokens);
+            for (int j = 0; j < n_tokens; j++) {
+                batch_add(batch, tokens[offsets[i] + j], n_prompt + j, seq_id, j < n_tokens - 1);
+            }
+
+            i++;
+        }
+
+        engine->scheduled.clear();
+
+        if (batch.n_tokens > 0 && llama_decode(engine->ctx, batch) != 0) {
+            fprintf(stderr, "failed to decode the candidates\n");
+            result = 1;
+        }
+
+        for (int k = first; k < i && result == 0; k++) {
+            const int n_tokens = offsets[k + 1] - offsets[k];
+
+            float sum = 0.0f;
+            for (int j = 0; j < n_tokens; j++) {
+                const float * logits = j == 0 ? prompt_logits.data() : llama_get_logits_ith(engine->ctx, starts[k - first] + j - 1);
+                sum += token_logprob(logits, n_vocab, tokens[offsets[k] + j]);
+            }
+
+            logprobs[k] = sum;
+        }
+
+        // back to the bare prompt for the next round
+        for (int k = first; k < i; k++) {
+            const llama_seq_id seq_id = seqs[k - first];
+            llama_kv_self_seq_rm(engine->ctx, seq_id, seq_id == seqs[0] ? n_prompt : 0, -1);
+        }
+    }
+
+    if (!seqs.empty()) {
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+
+        for (auto seq_id : seqs) {
+            llama_kv_self_seq_rm(engine->ctx, seq_id, -1, -1);
+        }
+    }
+
+    engine_return_seqs(engine, seqs);
+
+    engine_release_session(engine);
+    return result;
+}
+
+int llama_engine_prompt_n(llama_llm_engine * engine, const char * messages, int n, int n_predict, std::vector<std::string> & replies) {
+    auto vocab = llama_model_get_vocab(engine->model);
+    const int n_ctx_seq = llama_n_ctx(engine->ctx) / llama_n_seq_max(engine->ctx);
+
+    if (n <= 0) {
+        fprintf(stderr, "at least one reply has to be asked for\n");
+        return 1;
+    }
+
+    llama_arena arena;
+    std::vector<llama_chat_message> chat;
+    message_reader reader = {arena, chat};
+    if (!json::sax_parse(messages, &reader)) {
+        return 1;
+    }
+
+    for (auto & message : chat) {
+        if (message.role == nullptr || message.content == nullptr) {
+            fprintf(stderr, "every message needs a role and a content string\n");
+            return 1;
+        }
+    }
+
+    std::vector<char> formatted;
+    const int length = render(llama_model_chat_template(engine->model, nullptr), chat.data(), chat.size(), true, formatted);
+    if (length < 0) {
+        fprintf(stderr, "failed to apply the chat template\n");
+        return 1;
+    }
+
+    std::vector<llama_token> prompt_tokens;
+    tokenize(vocab, formatted.data(), length, true, prompt_tokens);
+
+    const llama_pos n_prompt = prompt_tokens.size();
+    if (n_prompt == 0 || n_prompt >= n_ctx_seq) {
+        fprintf(stderr, "the prompt has to fit the context of a sequence (%d tokens)\n", n_ctx_seq);
+        return 1;
+    }
+
+    std::vector<std::string> stops;
+    if (!llama_stop_from_json(engine->params, stops)) {
+        return 1;
+    }
+
+    std::unique_ptr<llama_stop_automaton> stop;
+    if (!stops.empty()) {
+        stop = std::make_unique<llama_stop_automaton>(stops);
+    }
+
+    // a clone would replay the same random state on the same logits, so every branch gets a chain
+    // of its own, seeded apart, or replies would only differ once a sampler keeps state of its own
+    const bool greedy = engine->params.contains("greedy") && engine->params["greedy"].is_boolean() && engine->params["greedy"];
+    const bool seeded = engine->params.contains("seed") && engine->params["seed"].is_number_integer() && engine->params["seed"] != LLAMA_DEFAULT_SEED;
+    const uint32_t seed = seeded ? engine->params["seed"].get<uint32_t>() : std::random_device()();
+
+    std::vector<llama_sampler *> smpls(n);
+    std::vector<llama_sampler *> grammars(n, nullptr);
+
+    // the grammar is parsed once, the other branches get clones
+    std::string grammar;
+    std::string grammar_root;
+    if (llama_grammar_from_json(engine->params, grammar, grammar_root)) {
+        grammars[0] = llama_sampler_init_grammar(vocab, grammar.c_str(), grammar_root.c_str());
+        if (grammars[0] == nullptr) {
+            fprintf(stderr, "failed to parse the grammar\n");
+            return 1;
+        }
+    }
+    else if (engine->params.contains("json_schema") && !engine->params["json_schema"].is_null()) {
+        // a schema that cannot be converted fails here as it does for a session
+        return 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        json params = engine->params;
+        if (!greedy) {
+            params["seed"] = (uint32_t) (seed + i);
+        }
+
+        smpls[i] = llama_sampler_from_json(engine->model, params);
+
+        if (i > 0 && grammars[0] != nullptr) {
+            grammars[i] = llama_sampler_clone(grammars[0]);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+
+        if (!engine->running || smpls[0] == nullptr) {
+            for (int i = 0; i < n; i++) {
+                if (smpls[i] != nullptr) {
+                    llama_sampler_free(smpls[i]);
+                }
+                if (grammars[i] != nullptr) {
+                    llama_sampler_free(grammars[i]);
+                }
+            }
+            return 1;
+        }
+
+        engine->n_callers++;
+    }
+
+    // a stop ends the replies where they are, like it does for a session
+    const uint32_t n_stops = engine->n_stops.load();
+    bool interrupted = false;
+
+    // the sequences are held for the whole call, the decodes in between leave ctx_mutex to the scheduler
+    std::vector<llama_seq_id> seqs;
+    engine_borrow_seqs(engine, seqs, n);
+
+    const int n_batch = llama_n_batch(engine->ctx);
+    auto & batch = engine->batch;
+    int result = 0;
+
+    if (seqs.empty()) {
+        fprintf(stderr, "no free sequence to generate with, raise n_seq_max\n");
+        result = 1;
+    }
+
+    // all but the last prompt token are decoded once, the last one starts every branch so each
+    // samples its first token from logits of its own sequence
+    const llama_pos n_shared = n_prompt - 1;
+
+    for (llama_pos i = 0; i < n_shared && result == 0; i += n_batch) {
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+
+        batch.n_tokens = 0;
+        for (llama_pos j = i; j < std::min<llama_pos>(n_shared, i + n_batch); j++) {
+            batch_add(batch, prompt_tokens[j], j, seqs[0], false);
+        }
+
+        engine->scheduled.clear();
+
+        if (llama_decode(engine->ctx, batch) != 0) {
+            fprintf(stderr, "failed to decode the prompt\n");
+            result = 1;
+        }
+    }
+
+    replies.assign(n, std::string());
+
+    // the branches run in lockstep, one token each per decode, as many at once as there are sequences
+    std::vector<llama_token> last(n);
+    std::vector<int32_t> n_generated(n);
+    std::vector<int32_t> stop_states(n, 0);
+    std::vector<llama_token_data> candidates;
+    std::vector<int> live;
+
+    for (int first = 0; first < n && result == 0 && !interrupted; first += seqs.size()) {
+        const int n_round = std::min<int>(n - first, seqs.size());
+
+        {
+            std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+
+            for (int k = 1; k < n_round && n_shared > 0; k++) {
+                llama_kv_self_seq_cp(engine->ctx, seqs[0], seqs[k], 0, n_shared);
+            }
+        }
+
+        live.clear();
+        for (int k = 0; k < n_round; k++) {
+            last[first + k] = prompt_tokens.back();
+            n_generated[first + k] = 0;
+            live.push_back(k);
+        }
+
+        while (!live.empty() && result == 0) {
+            std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+
+            batch.n_tokens = 0;
+            for (int k : live) {
+                batch_add(batch, last[first + k], n_shared + n_generated[first + k], seqs[k], true);
+            }
+
+            engine->scheduled.clear();
+
+            if (!engine->running) {
+                result = 1;
+                break;
+            }
+
+            if (engine->n_stops.load() != n_stops) {
+                interrupted = true;
+                break;
+            }
+
+            if (llama_decode(engine->ctx, batch) != 0) {
+                fprintf(stderr, "failed to decode the branches\n");
+                result = 1;
+                break;
+            }
+
+            size_t n_live = 0;
+            for (size_t i = 0; i < live.size(); i++) {
+                const int b = first + live[i];
+                const llama_token token = sample_constrained(engine->ctx, smpls[b], grammars[b], i, candidates);
+
+                if (llama_vocab_is_eog(vocab, token)) {
+                    continue;
+                }
+
+                char buf[256];
+                const int length = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true);
+                if (length < 0) {
+                    fprintf(stderr, "failed to convert token to piece\n");
+                    result = 1;
+                    break;
+                }
+
+                replies[b].append(buf, length);
+                last[b] = token;
+                n_generated[b]++;
+
+                // a reply that completed a stop string ends right before it
+                bool stopped = false;
+                for (size_t j = replies[b].size() - length; stop != nullptr && j < replies[b].size(); j++) {
+                    stop_states[b] = stop->next(stop_states[b], replies[b][j]);
+
+                    if (const uint32_t n_match = stop->match(stop_states[b])) {
+                        replies[b].resize(j + 1 - n_match);
+                        stopped = true;
+                        break;
+                    }
+                }
+
+                if (stopped) {
+                    continue;
+                }
+
+                // the next step would decode the token past the context or the budget
+                if ((n_predict > 0 && n_generated[b] >= n_predict) || n_shared + n_generated[b] + 1 > n_ctx_seq) {
+                    continue;
+                }
+
+                live[n_live++] = live[i];
+            }
+
+            live.resize(n_live);
+        }
+
+        // back to the shared prompt for the next round
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+
+        for (int k = 0; k < n_round; k++) {
+            llama_kv_self_seq_rm(engine->ctx, seqs[k], k == 0 ? n_shared : 0, -1);
+        }
+    }
+
+    if (!seqs.empty()) {
+        std::lock_guard<std::mutex> ctx_lock(engine->ctx_mutex);
+
+        for (auto seq_id : seqs) {
+            llama_kv_self_seq_rm(engine->ctx, seq_id, -1, -1);
+        }
+    }
+
+    engine_return_seqs(engine, seqs);
+
+    for (int i = 0; i < n; i++) {
+        llama_sampler_free(smpls[i]);
+        if (grammars[i] != nullptr) {
+            llama_sampler_free(grammars[i]);
+        }
+    }
+
+    engine_release_session(engine);
+    return result;
+}
@@ -0,0 +1,210 @@
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+
+#include "api.h"
+#include "arena.hpp"
+#include "llama.h"
+#include "params.hpp"
+#include "ring.hpp"
+#include "sampler_cache.hpp"
+#include "speculative.hpp"
+#include "token_cache.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct llama_llm_session {
+    int id = -1;
+    llama_seq_id seq_id = -1;
+    llama_sampler * smpl = nullptr;
+    llama_sampler * grammar = nullptr; // kept out of smpl, checked against the sampled token first
+    std::string sampler_params; // the sampler parameters smpl was built from, empty for the init ones
+    std::shared_ptr<const llama_stop_automaton> stop_strings; // compiled from sampler_params, nullptr if none
+
+    /// Scheduler state, guarded by the engine mutex
+    std::vector<llama_token> prompt;  // prompt tokens of the current request
+    int32_t n_prompt_done = 0;        // prompt tokens already decoded
+    std::vector<llama_token> tokens;  // tokens of this sequence resident in the KV cache
+    size_t n_sink = 0;                // leading tokens a context shift never discards
+    size_t n_discarded = 0;           // history tokens shifted out between the sink tokens and the rest
+    llama_token sampled = -1;         // last sampled token, decoded on the next step
+    std::vector<llama_token> draft;   // drafted tokens decoded after sampled in the current step
+    int32_t i_batch = -1;             // index of this session's logits in the current batch
+    llama_pos step_pos = 0;           // resident tokens before the current step, to roll back an aborted decode
+    int32_t step_prompt = 0;          // prompt tokens added in the current step
+    size_t save_at = 0;               // capture the sequence state once this many tokens are resident
+    std::vector<uint8_t> saved_state;
+    int32_t stop_state = 0;           // state of the stop automaton after the reply so far
+    std::string stop_held;            // end of the reply that could still begin a stop string
+    bool active = false;              // a request is queued or running
+    bool finished = false;            // the scheduler has produced the final piece
+    bool freed = false;
+    int result = 0;
+
+    /// Decoding counters of the current request
+    int32_t n_generated = 0; // tokens sampled for the reply
+    int32_t n_steps = 0;     // decodes the reply took
+    int32_t n_drafted = 0;   // draft tokens verified
+    int32_t n_accepted = 0;  // draft tokens that matched the sampled token
+    int32_t n_flushes = 0;   // output callbacks the reply took
+
+    llama_output_ring output;        // pieces of the reply, written by the scheduler and read by the caller
+    llama_output_ring records;       // a logprob record per piece, while logprobs is set
+    dart_logprobs * logprobs = nullptr;
+    int32_t n_top = 0;               // alternatives in each logprob record
+    std::atomic_bool blocked{false}; // the scheduler waits for room in output
+    dart_progress * progress = nullptr;
+    std::condition_variable cv;
+
+    /// Caller side of the current request
+    std::string pending;              // output read from the ring but not handed over yet
+    std::string pending_records;      // logprob records read from their ring but not handed over yet
+    int32_t n_prompt = 0;             // prompt tokens of the request, for progress
+    int32_t n_reported = 0;           // prompt tokens already reported as progress
+    std::string prefix_path;          // where the captured prefix state is written
+    std::vector<llama_token> prefix;  // tokens of the captured prefix
+
+    /// Held by the caller for the duration of a prompt, suspend or resume
+    std::mutex busy;
+    std::vector<std::pair<std::string, std::string>> history; // role and content of the messages appended so far
+
+    /// Buffers of the prompt path, guarded by busy and reused by every request
+    llama_arena arena;                        // strings of the parsed messages
+    std::vector<llama_chat_message> messages; // messages of the current request
+    std::vector<char> formatted;              // the rendered chat
+    std::vector<llama_token> prompt_tokens;
+    std::vector<char> rendered;               // the leading system messages alone
+    std::vector<llama_token> prefix_tokens;
+    std::string flushed;                      // text handed to the output callback
+
+    /// The chat as rendered by earlier requests, with a template that renders every message on its
+    /// own only the messages after the last unchanged render are rendered again
+    std::vector<uint64_t> chat_hashes;                       // role and content of each rendered message
+    std::vector<llama_token> chat_tokens;                    // the rendered messages, without a generation prompt
+    std::vector<std::pair<size_t, size_t>> chat_checkpoints; // message and token counts where a render ended
+    std::atomic<int32_t> n_rendered{0};                      // messages the last request rendered
+    std::atomic<int32_t> n_tokens_cached{0};                 // prompt tokens the last request took from the token cache
+    uint64_t allocations_start = 0;           // engine allocation count when the request started
+    int32_t n_allocations = 0;                // heap allocations the last request made, guarded by the engine mutex
+    std::string state_path;   // state file of a suspended session
+    bool state_owned = false; // state_path was written by the engine and is removed after resuming
+    uint64_t last_used = 0;
+
+    std::atomic_bool stop{false};
+
+    ~llama_llm_session();
+};
+
+struct llama_llm_engine {
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+    json params;
+
+    std::string cache_dir; // prompt prefix cache, disabled when empty
+    uint64_t cache_key = 0; // model file and context parameters the cached states belong to
+
+    std::string session_dir;   // where idle sessions are evicted to, eviction is disabled when empty
+    size_t session_budget = 0; // bytes of KV state resident sessions may use before idle ones are evicted
+    uint64_t tick = 0;
+
+    bool context_shift = true; // discard old tokens when a sequence is full instead of stopping
+    int32_t n_keep = -1;       // sink tokens kept by a context shift, -1 keeps the system prompt
+
+    llama_draft * draft = nullptr; // draft model, prompt lookup drafts when there is none
+    int32_t n_draft = 0;           // most tokens drafted per step, 0 disables speculative decoding
+    int32_t draft_ngram_min = 2;   // shortest n-gram a lookup may match
+    int32_t draft_ngram_max = 4;
+
+    int32_t stream_flush_tokens = 1; // pieces buffered before the output callback is called
+    int32_t stream_flush_ms = 0;     // longest a buffered piece waits for more, 0 waits for stream_flush_tokens
+
+    size_t output_size = 65536;  // bytes of output buffered per session
+    size_t output_reserve = 0;   // room a generating step needs in the output ring
+    bool output_block = true;    // a full output ring pauses the reply, otherwise it ends it
+
+    bool chat_incremental = false; // the chat template renders every message on its own
+    llama_token_cache token_cache; // tokens of long rendered segments, shared by all sessions
+    bool embeddings = false;       // the context outputs embeddings outside of embedding calls
+    llama_sampler_cache samplers;  // chains of the sampler parameters requests asked for
+
+    /// Held by whoever is touching ctx: the scheduler around decode and sampling,
+    /// callers around KV cache edits. Always taken before mutex.
+    std::mutex ctx_mutex;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread worker;
+    bool running = false;
+    int n_callers = 0;
+    std::atomic<uint32_t> n_stops{0}; // raised by llama_engine_stop_all for the calls that run outside sessions
+
+    std::map<int, std::shared_ptr<llama_llm_session>> sessions;
+    std::vector<llama_llm_session *> scheduled; // sessions in the batch being decoded
+    std::vector<bool> seq_used;
+    int next_id = 0;
+
+    std::map<int, int> requests; // session of each submitted request that is still replying
+    int next_request = 0;
+    std::map<int, std::thread> deliveries; // thread handing over each submitted reply, joined once done
+    std::vector<int> delivered;            // requests whose thread has finished and awaits its join
+
+    std::atomic<uint64_t> n_allocations{0}; // heap allocations made by the buffers of the prompt path
+
+    llama_batch batch = {};
+};
+
+llama_llm_engine * llama_engine_init(llama_model * model, llama_context * ctx, llama_draft * draft, json & params);
+
+void llama_engine_free(llama_llm_engine * engine);
+
+int llama_engine_session_create(llama_llm_engine * engine);
+
+int llama_engine_session_prompt(llama_llm_engine * engine, int id, const char * messages, dart_output * output);
+
+int llama_engine_session_suspend(llama_llm_engine * engine, int id, const std::string & path);
+
+int llama_engine_session_resume(llama_llm_engine * engine, int id, const std::string & path);
+
+void llama_engine_session_set_progress(llama_llm_engine * engine, int id, dart_progress * progress);
+
+int llama_engine_session_set_logprobs(llama_llm_engine * engine, int id, int n_top, dart_logprobs * logprobs);
+
+int llama_engine_session_set_sampler(llama_llm_engine * engine, int id, const char * params);
+
+int llama_engine_session_start(llama_llm_engine * engine, int id, const char * messages);
+
+int llama_engine_session_submit(llama_llm_engine * engine, int id, const char * messages, dart_response * response);
+
+int llama_engine_session_submit_history(llama_llm_engine * engine, int id, dart_response * response);
+
+int llama_engine_session_append(llama_llm_engine * engine, int id, const char * role, const char * content);
+
+int llama_engine_session_truncate(llama_llm_engine * engine, int id, int n_messages);
+
+void llama_engine_request_cancel(llama_llm_engine * engine, int request);
+
+int llama_engine_session_poll(llama_llm_engine * engine, int id, char * buffer, int size);
+
+json llama_engine_session_stats(llama_llm_engine * engine, int id);
+
+void llama_engine_session_stop(llama_llm_engine * engine, int id);
+
+void llama_engine_stop_all(llama_llm_engine * engine);
+
+int llama_engine_session_free(llama_llm_engine * engine, int id);
+
+int llama_engine_embed(llama_llm_engine * engine, const char * const * texts, int n_texts, float * embeddings, bool normalize);
+
+int llama_engine_rerank(llama_llm_engine * engine, const char * query, const char * const * passages, int n_passages, float * scores);
+
+int llama_engine_loglikelihood(llama_llm_engine * engine, const char * prompt, const char * const * candidates, int n_candidates, float * logprobs);
+
+int llama_engine_prompt_n(llama_llm_engine * engine, const char * messages, int n, int n_predict, std::vector<std::string> & replies);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// FNV-1a, stable across runs and platforms so it can be used for on-disk keys
+inline uint64_t fnv1a_hash(const void * data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    auto bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+inline uint64_t fnv1a_hash(const std::string & str, uint64_t hash = 14695981039346656037ULL) {
+    return fnv1a_hash(str.data(), str.size(), hash);
+}
+
+#endif
@@ -0,0 +1,383 @@
+#include "json_schema.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <vector>
+
+// the JSON primitives, with the rules each one refers to
+static const std::map<std::string, std::pair<std::string, std::vector<std::string>>> primitive_rules = {
+    {"space", {"| \" \" | \"\\n\" [ \\t]{0,20}", {}}},
+    {"boolean", {"(\"true\" | \"false\") space", {"space"}}},
+    {"decimal-part", {"[0-9]{1,16}", {}}},
+    {"integral-part", {"[0] | [1-9] [0-9]{0,15}", {}}},
+    {"number", {"(\"-\"? integral-part) (\".\" decimal-part)? ([eE] [-+]? integral-part)? space", {"integral-part", "decimal-part", "space"}}},
+    {"integer", {"(\"-\"? integral-part) space", {"integral-part", "space"}}},
+    {"char", {"[^\"\\\\\\x7F\\x00-\\x1F] | [\\\\] ([\"\\\\bfnrt] | \"u\" [0-9a-fA-F]{4})", {}}},
+    {"string", {"\"\\\"\" char* \"\\\"\" space", {"char", "space"}}},
+    {"null", {"\"null\" space", {"space"}}},
+    {"value", {"object | array | string | number | boolean | null", {"object", "array", "string", "number", "boolean", "null"}}},
+    {"object", {"\"{\" space ( string \":\" space value (\",\" space string \":\" space value)* )? \"}\" space", {"string", "value", "space"}}},
+    {"array", {"\"[\" space ( value (\",\" space value)* )? \"]\" space", {"value", "space"}}},
+};
+
+// a GBNF string literal matching text exactly
+static std::string literal(const std::string & text) {
+    std::string out = "\"";
+    for (char c : text) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:   out += c;
+        }
+    }
+
+    return out + "\"";
+}
+
+// rule names may only hold letters, digits and dashes
+static std::string rule_name(const std::string & text) {
+    std::string out = text;
+    for (auto & c : out) {
+        if (!isalnum((unsigned char) c) && c != '-') {
+            c = '-';
+        }
+    }
+
+    return out.empty() ? "rule" : out;
+}
+
+// {min,max} in GBNF, max < 0 being unbounded
+static std::string repetition(int64_t min, int64_t max) {
+    if (max < 0) {
+        return min == 0 ? "*" : min == 1 ? "+" : "{" + std::to_string(min) + ",}";
+    }
+
+    if (min == max) {
+        return min == 1 ? "" : "{" + std::to_string(min) + "}";
+    }
+
+    return min == 0 && max == 1 ? "?" : "{" + std::to_string(min) + "," + std::to_string(max) + "}";
+}
+
+struct schema_converter {
+    const json & root;
+    std::vector<std::pair<std::string, std::string>> rules; // in the order they were added
+    std::map<std::string, std::string> refs;                // rule of each $ref resolved so far
+    bool failed = false;
+
+    explicit schema_converter(const json & root) : root(root) {}
+
+    // adds name ::= body, a different rule of the same name gets a numbered name
+    std::string add_rule(const std::string & name, const std::string & body) {
+        std::string unique = name;
+        for (int i = 1;; i++) {
+            auto it = std::find_if(rules.begin(), rules.end(), [&](auto & rule) { return rule.first == unique; });
+            if (it == rules.end()) {
+                break;
+            }
+            if (it->second == body) {
+                return unique;
+            }
+            unique = name + std::to_string(i);
+        }
+
+        rules.push_back({unique, body});
+        return unique;
+    }
+
+    // takes a name no rule has yet before the body of its rule is known
+    std::string reserve_rule(const std::string & name) {
+        std::string unique = name;
+        for (int i = 1; std::any_of(rules.begin(), rules.end(), [&](auto & rule) { return rule.first == unique; }); i++) {
+            unique = name + std::to_string(i);
+        }
+
+        rules.push_back({unique, ""});
+        return unique;
+    }
+
+    std::string primitive(const std::string & name) {
+        if (std::none_of(rules.begin(), rules.end(), [&](auto & rule) { return rule.first == name; })) {
+            auto & [body, deps] = primitive_rules.at(name);
+            rules.push_back({name, body});
+            for (auto & dep : deps) {
+                primitive(dep);
+            }
+        }
+
+        return name;
+    }
+
+    std::string fail(const char * message) {
+        fprintf(stderr, "unsupported json schema: %s\n", message);
+        failed = true;
+        return "value";
+    }
+
+    const json * resolve(const std::string & ref) {
+        if (ref.rfind("#/", 0) != 0 || !root.contains(json::json_pointer(ref.substr(1)))) {
+            return nullptr;
+        }
+
+        return &root.at(json::json_pointer(ref.substr(1)));
+    }
+
+    std::string visit_ref(const std::string & ref) {
+        auto it = refs.find(ref);
+        if (it != refs.end()) {
+            return it->second;
+        }
+
+        const json * schema = resolve(ref);
+        if (schema == nullptr) {
+            return fail("only local $refs are supported");
+        }
+
+        // reserved before the visit, so a recursive schema refers back to its own rule and
+        // refs ending in the same segment get rules of their own
+        const std::string name = reserve_rule(rule_name("ref-" + ref.substr(ref.find_last_of('/') + 1)));
+        refs[ref] = name;
+
+        const std::string body = visit(*schema, name + "-body");
+        std::find_if(rules.begin(), rules.end(), [&](auto & rule) { return rule.first == name; })->second = body;
+
+        return name;
+    }
+
+    std::string visit_object(const json & schema, const std::string & name) {
+        if (!schema.contains("properties") || !schema["properties"].is_object()) {
+            if (schema.contains("additionalProperties") && schema["additionalProperties"].is_object()) {
+                const std::string value = visit(schema["additionalProperties"], name + "-value");
+                const std::string kv = primitive("string") + " \":\" space " + value;
+
+                return add_rule(name, "\"{\" space ( " + kv + " (\",\" space " + kv + ")* )? \"}\" space");
+            }
+
+            return primitive("object");
+        }
+
+        std::set<std::string> required;
+        if (schema.contains("required") && schema["required"].is_array()) {
+            for (auto & key : schema["required"]) {
+                if (key.is_string()) {
+                    required.insert(key.get<std::string>());
+                }
+            }
+        }
+
+        // required keys come first, then the optional ones, each in the order of properties
+        std::vector<std::string> kv_required;
+        std::vector<std::string> kv_optional;
+
+        for (auto & [key, property] : schema["properties"].items()) {
+            const std::string prop_name = name + "-" + rule_name(key);
+            const std::string value = visit(property, prop_name);
+            const std::string kv = add_rule(prop_name + "-kv", literal(json(key).dump()) + " space \":\" space " + value);
+
+            (required.count(key) > 0 ? kv_required : kv_optional).push_back(kv);
+        }
+
+        primitive("space");
+
+        std::string body = "\"{\" space";
+        for (size_t i = 0; i < kv_required.size(); i++) {
+            body += (i > 0 ? " \",\" space " : " ") + kv_required[i];
+        }
+
+        if (!kv_optional.empty()) {
+            // opt[i] holds any of the optional keys from i on, in order, each after a comma, opt[0] is
+            // only used after a required key
+            std::vector<std::string> opt(kv_optional.size() + 1);
+            const size_t first = kv_required.empty() ? 1 : 0;
+            for (size_t i = kv_optional.size(); i-- > first;) {
+                opt[i] = add_rule(name + "-opt-" + std::to_string(i), "( \",\" space " + kv_optional[i] + " )?" + (opt[i + 1].empty() ? "" : " " + opt[i + 1]));
+            }
+
+            if (!kv_required.empty()) {
+                body += " " + opt[0];
+            }
+            else {
+                // without a required key the first one present takes no comma
+                std::string alternatives;
+                for (size_t i = 0; i < kv_optional.size(); i++) {
+                    alternatives += (i > 0 ? " | " : "") + kv_optional[i] + (opt[i + 1].empty() ? "" : " " + opt[i + 1]);
+                }
+                body += " ( " + alternatives + " )?";
+            }
+        }
+
+        return add_rule(name, body + " \"}\" space");
+    }
+
+    std::string visit_array(const json & schema, const std::string & name) {
+        primitive("space");
+
+        if (schema.contains("prefixItems") && schema["prefixItems"].is_array()) {
+            std::string body = "\"[\" space";
+            for (size_t i = 0; i < schema["prefixItems"].size(); i++) {
+                body += (i > 0 ? " \",\" space " : " ") + visit(schema["prefixItems"][i], name + "-" + std::to_string(i));
+            }
+
+            return add_rule(name, body + " \"]\" space");
+        }
+
+        const std::string item = schema.contains("items") ? visit(schema["items"], name + "-item") : primitive("value");
+        const int64_t min = schema.contains("minItems") && schema["minItems"].is_number_integer() ? schema["minItems"].get<int64_t>() : 0;
+        const int64_t max = schema.contains("maxItems") && schema["maxItems"].is_number_integer() ? schema["maxItems"].get<int64_t>() : -1;
+
+        if (max == 0) {
+            return add_rule(name, "\"[\" space \"]\" space");
+        }
+
+        const int64_t rest_min = std::max<int64_t>(min - 1, 0);
+        const int64_t rest_max = max < 0 ? -1 : max - 1;
+        std::string list = item;
+        if (rest_max != 0) {
+            list += " ( \",\" space " + item + " )" + repetition(rest_min, rest_max);
+        }
+
+        return add_rule(name, "\"[\" space " + (min == 0 ? "( " + list + " )?" : list) + " \"]\" space");
+    }
+
+    std::string visit_string(const json & schema, const std::string & name) {
+        const bool bounded = schema.contains("minLength") || schema.contains("maxLength");
+        if (!bounded) {
+            return primitive("string");
+        }
+
+        const int64_t min = schema.contains("minLength") && schema["minLength"].is_number_integer() ? schema["minLength"].get<int64_t>() : 0;
+        const int64_t max = schema.contains("maxLength") && schema["maxLength"].is_number_integer() ? schema["maxLength"].get<int64_t>() : -1;
+
+        primitive("char");
+        primitive("space");
+
+        return add_rule(name, "\"\\\"\" char" + repetition(min, max) + " \"\\\"\" space");
+    }
+
+    // allOf of objects, merged into one object schema
+    std::string visit_all_of(const json & schema, const std::string & name) {
+        json merged = {{"type", "object"}, {"properties", json::object()}, {"required", json::array()}};
+
+        for (auto & part : schema["allOf"]) {
+            const json * sub = &part;
+            if (sub->contains("$ref") && (*sub)["$ref"].is_string()) {
+                sub = resolve((*sub)["$ref"].get<std::string>());
+            }
+
+            if (sub == nullptr || !sub->contains("properties")) {
+                return fail("allOf only combines objects with properties");
+            }
+
+            merged["properties"].update((*sub)["properties"]);
+            if (sub->contains("required") && (*sub)["required"].is_array()) {
+                for (auto & key : (*sub)["required"]) {
+                    merged["required"].push_back(key);
+                }
+            }
+        }
+
+        return visit_object(merged, name);
+    }
+
+    std::string visit(const json & schema, const std::string & name) {
+        if (schema.is_boolean() || (schema.is_object() && schema.empty())) {
+            return primitive("value");
+        }
+
+        if (!schema.is_object()) {
+            return fail("a schema has to be an object");
+        }
+
+        if (schema.contains("$ref") && schema["$ref"].is_string()) {
+            return visit_ref(schema["$ref"].get<std::string>());
+        }
+
+        if (schema.contains("const")) {
+            return add_rule(name, literal(schema["const"].dump()) + " " + primitive("space"));
+        }
+
+        if (schema.contains("enum") && schema["enum"].is_array()) {
+            std::string body;
+            for (auto & value : schema["enum"]) {
+                body += (body.empty() ? "" : " | ") + literal(value.dump());
+            }
+
+            return add_rule(name, "(" + body + ") " + primitive("space"));
+        }
+
+        for (const char * key : {"anyOf", "oneOf"}) {
+            if (schema.contains(key) && schema[key].is_array()) {
+                std::string body;
+                for (size_t i = 0; i < schema[key].size(); i++) {
+                    body += (i > 0 ? " | " : "") + visit(schema[key][i], name + "-" + std::to_string(i));
+                }
+
+                return add_rule(name, body);
+            }
+        }
+
+        if (schema.contains("allOf") && schema["allOf"].is_array()) {
+            return visit_all_of(schema, name);
+        }
+
+        if (schema.contains("type") && schema["type"].is_array()) {
+            std::string body;
+            for (auto & type : schema["type"]) {
+                json single = schema;
+                single["type"] = type;
+                body += (body.empty() ? "" : " | ") + visit(single, name + "-" + rule_name(type.is_string() ? type.get<std::string>() : type.dump()));
+            }
+
+            return add_rule(name, body);
+        }
+
+        const std::string type = schema.contains("type") && schema["type"].is_string() ? schema["type"].get<std::string>() : "";
+
+        if (type == "object" || (type.empty() && schema.contains("properties"))) {
+            return visit_object(schema, name);
+        }
+
+        if (type == "array" || (type.empty() && (schema.contains("items") || schema.contains("prefixItems")))) {
+            return visit_array(schema, name);
+        }
+
+        if (type == "string") {
+            return visit_string(schema, name);
+        }
+
+        if (type == "number" || type == "integer" || type == "boolean" || type == "null") {
+            return primitive(type);
+        }
+
+        if (!type.empty()) {
+            return fail("unknown type");
+        }
+
+        return primitive("value");
+    }
+};
+
+bool llama_json_schema_to_grammar(const json & schema, std::string & grammar) {
+    schema_converter converter(schema);
+
+    const std::string root = converter.visit(schema, "root");
+    if (converter.failed) {
+        return false;
+    }
+
+    if (root != "root") {
+        converter.add_rule("root", root);
+    }
+
+    grammar.clear();
+    for (auto & [name, body] : converter.rules) {
+        grammar += name + " ::= " + body + "\n";
+    }
+
+    return true;
+}
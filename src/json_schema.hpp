@@ -0,0 +1,16 @@
+#ifndef JSON_SCHEMA_HPP
+#define JSON_SCHEMA_HPP
+
+#include "params.hpp"
+#include <string>
+
+/// Converts a JSON schema to a GBNF grammar whose root rule is "root", so the
+/// output is a JSON value the schema accepts. Covers object properties with
+/// required and optional keys, arrays with items, prefixItems and length
+/// bounds, strings with length bounds, numbers, integers, booleans, null,
+/// enum, const, anyOf, oneOf, allOf of objects and local $refs. Formats and
+/// patterns are not checked, such strings match any string. Returns false if
+/// the schema cannot be converted.
+bool llama_json_schema_to_grammar(const json & schema, std::string & grammar);
+
+#endif
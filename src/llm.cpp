@@ -2,10 +2,12 @@
 #include "llama.h"
 #include "llama_cpp/vendor/nlohmann/json.hpp"
 #include "params.hpp"
+#include "engine.hpp"
+#include "vector_store.hpp"
 #include <cassert>
-#include <vector>
-#include <atomic>
+#include <map>
 #include <mutex>
+#include <vector>
 
 
 #include <iostream> // For std::cerr
@@ -14,32 +16,13 @@
 #include <filesystem> // For std::filesystem (C++17)
 
 
-static std::atomic_bool stop_generation(false);
-static std::mutex continue_mutex;
-
-static llama_model * model = nullptr;
-static llama_context * ctx = nullptr;
-static llama_sampler * smpl = nullptr;
-static int prev_len = 0;
-
-std::vector<llama_chat_message> llama_parse_messages(char * messages) {
-    auto json_messages = json::parse(messages);
-    std::vector<llama_chat_message> result;
-
-    for (auto & message : json_messages) {
-        auto role = message["role"].get<std::string>();
-        auto content = message["content"].get<std::string>();
-
-        llama_chat_message msg = {
-            strdup(role.c_str()),
-            strdup(content.c_str())
-        };
+static llama_llm_engine * engine = nullptr;
+static int default_session = -1;
 
-        result.push_back(msg);
-    }
-
-    return result;
-}
+// vector stores do not need a model, they outlive llama_llm_free
+static std::map<int, std::shared_ptr<llama_vector_store>> vector_stores;
+static std::mutex vector_stores_mutex;
+static int next_vector_store = 0;
 
 char * llama_default_params(void) {
     json params = json::object();
@@ -83,30 +66,6 @@ char * llama_default_params(void) {
     return strdup(params.dump().c_str());
 }
 
-/*int llama_llm_init(char * params) {
-    auto json_params = json::parse(params);
-
-    if (!json_params.contains("model_path") || !json_params["model_path"].is_string()) {
-        fprintf(stderr, "Missing 'model_path' in parameters\n");
-        return 1;
-    }
-
-    auto model_path = json_params["model_path"].get<std::string>();
-
-    auto model_params = llama_model_params_from_json(json_params);
-    auto context_params = llama_context_params_from_json(json_params);
-
-    ggml_backend_load_all();
-
-    model = llama_model_load_from_file(model_path.c_str(), model_params);
-    ctx = llama_init_from_model(model, context_params);
-    smpl = llama_sampler_from_json(model, json_params);
-
-    prev_len = 0;
-
-    return 0;
-}*/
-
 int llama_llm_init(char * params_json_str) { // Use a different parameter name to avoid confusion
     auto json_params = json::parse(params_json_str);
 
@@ -117,8 +76,6 @@ int llama_llm_init(char * params_json_str) { // Use a different parameter name t
 
     std::string s_model_path = json_params["model_path"].get<std::string>();
 
-    std::cerr << "DEBUG (C++): Received model_path: " << s_model_path << std::endl;
-
     // Use std::filesystem for robust path handling and check
     std::filesystem::path fs_model_path(s_model_path);
 
@@ -139,8 +96,6 @@ int llama_llm_init(char * params_json_str) { // Use a different parameter name t
         }
     }
     
-    std::cerr << "DEBUG (C++): Final model path being used (absolute/canonical): " << canonical_path.string() << std::endl;
-
     // Verify the file exists and is a regular file using std::filesystem
     if (!std::filesystem::exists(canonical_path, ec)) {
         std::cerr << "ERROR (C++): Model file does NOT exist at path: " << canonical_path.string() << " (Error: " << ec.message() << ")" << std::endl;
@@ -152,139 +107,387 @@ int llama_llm_init(char * params_json_str) { // Use a different parameter name t
     }
 
     // Use the canonicalized or absolute path for llama_load_model_from_file
-    const char* final_model_path_c_str = canonical_path.string().c_str();
+    const std::string final_model_path = canonical_path.string();
+    const char* final_model_path_c_str = final_model_path.c_str();
 
     auto model_params = llama_model_params_from_json(json_params);
     auto context_params = llama_context_params_from_json(json_params);
 
+    if (engine != nullptr) {
+        llama_llm_free();
+    }
+
     ggml_backend_load_all();
 
-    std::cerr << "DEBUG (C++): Calling llama_model_load_from_file with path: " << final_model_path_c_str << std::endl;
-    model = llama_model_load_from_file(final_model_path_c_str, model_params);
+    auto model = llama_model_load_from_file(final_model_path_c_str, model_params);
 
     if (model == nullptr) {
         std::cerr << "ERROR (C++): llama_model_load_from_file returned nullptr for: " << final_model_path_c_str << std::endl;
         return 1;
     }
 
-    std::cerr << "DEBUG (C++): Model loaded successfully. Initializing context." << std::endl;
-
-    ctx = llama_init_from_model(model, context_params);
+    auto ctx = llama_init_from_model(model, context_params);
     
     if (ctx == nullptr) {
         std::cerr << "ERROR (C++): llama_init_from_model returned nullptr." << std::endl;
-        llama_free_model(model);
-        model = nullptr;
+        llama_model_free(model);
         return 1;
     }
 
-    smpl = llama_sampler_from_json(model, json_params);
+    llama_draft * draft = nullptr;
 
-    prev_len = 0;
+    if (json_params.contains("draft_model_path") && json_params["draft_model_path"].is_string()) {
+        draft = llama_draft_init(json_params["draft_model_path"].get<std::string>(), json_params, model, ctx);
 
-    std::cerr << "DEBUG (C++): LLM initialization successful." << std::endl;
+        if (draft == nullptr) {
+            llama_free(ctx);
+            llama_model_free(model);
+            return 1;
+        }
+    }
+
+    engine = llama_engine_init(model, ctx, draft, json_params);
+    default_session = llama_engine_session_create(engine);
+
+    // the default session takes the sampler parameters, a bad one fails the whole init
+    if (default_session < 0) {
+        llama_llm_free();
+        return 1;
+    }
 
     return 0;
 }
 
 
 int llama_prompt(char * msgs, dart_output * output) {
-    auto messages = llama_parse_messages(msgs);
+    return llama_session_prompt(default_session, msgs, output);
+}
+
+int llama_submit(char * msgs, dart_response * response) {
+    return llama_session_submit(default_session, msgs, response);
+}
+
+int llama_submit_history(dart_response * response) {
+    return llama_session_submit_history(default_session, response);
+}
+
+int llama_append(char * role, char * content) {
+    return llama_session_append(default_session, role, content);
+}
+
+int llama_truncate(int n_messages) {
+    return llama_session_truncate(default_session, n_messages);
+}
+
+void llama_request_cancel(int request) {
+    if (engine != nullptr) {
+        llama_engine_request_cancel(engine, request);
+    }
+}
+
+void llama_free_string(char * string) {
+    free(string);
+}
+
+int llama_start(char * msgs) {
+    return llama_session_start(default_session, msgs);
+}
 
-    std::lock_guard<std::mutex> lock(continue_mutex);
-    stop_generation.store(false);
+int llama_poll_output(char * buffer, int size) {
+    return llama_session_poll_output(default_session, buffer, size);
+}
+
+void llama_set_progress(dart_progress * progress) {
+    llama_session_set_progress(default_session, progress);
+}
 
-    assert(model != nullptr);
-    assert(ctx != nullptr);
-    assert(smpl != nullptr);
+int llama_set_logprobs(int n_top, dart_logprobs * logprobs) {
+    return llama_session_set_logprobs(default_session, n_top, logprobs);
+}
 
-    auto vocab = llama_model_get_vocab(model);
+int llama_set_sampler(char * params) {
+    return llama_session_set_sampler(default_session, params);
+}
 
-    std::vector<char> formatted(llama_n_ctx(ctx));
+int llama_token_piece(int token, char * buffer, int size) {
+    assert(engine != nullptr);
 
-    const char * tmpl = llama_model_chat_template(model, nullptr);
-    int new_len = llama_chat_apply_template(tmpl, messages.data(), messages.size(), true, formatted.data(), formatted.size());
-    if (new_len > (int) formatted.size()) {
-        formatted.resize(new_len);
-        new_len = llama_chat_apply_template(tmpl, messages.data(), messages.size(), true, formatted.data(), formatted.size());
+    auto vocab = llama_model_get_vocab(engine->model);
+    if (token < 0 || token >= llama_vocab_n_tokens(vocab) || size <= 0) {
+        return -1;
     }
 
-    if (new_len < 0) {
-        fprintf(stderr, "failed to apply the chat template\n");
+    const int n = llama_token_to_piece(vocab, token, buffer, size - 1, 0, true);
+    if (n < 0) {
+        return -1;
+    }
+
+    buffer[n] = '\0';
+    return n;
+}
+
+char * llama_stats(void) {
+    return llama_session_stats(default_session);
+}
+
+void llama_llm_stop(void) {
+    if (engine != nullptr) {
+        llama_engine_stop_all(engine);
+    }
+}
+
+void llama_llm_free(void) {
+    if (engine != nullptr) {
+        llama_engine_free(engine);
+        engine = nullptr;
+    }
+
+    default_session = -1;
+}
+
+int llama_session_create(void) {
+    assert(engine != nullptr);
+
+    return llama_engine_session_create(engine);
+}
+
+int llama_session_prompt(int session, char * msgs, dart_output * output) {
+    assert(engine != nullptr);
+
+    return llama_engine_session_prompt(engine, session, msgs, output);
+}
+
+int llama_session_submit(int session, char * msgs, dart_response * response) {
+    assert(engine != nullptr);
+
+    return llama_engine_session_submit(engine, session, msgs, response);
+}
+
+int llama_session_submit_history(int session, dart_response * response) {
+    assert(engine != nullptr);
+
+    return llama_engine_session_submit_history(engine, session, response);
+}
+
+int llama_session_append(int session, char * role, char * content) {
+    assert(engine != nullptr);
+
+    if (role == nullptr || content == nullptr) {
         return 1;
     }
 
-    // remove previous messages to obtain the prompt to generate the response
-    std::string prompt(formatted.begin() + prev_len, formatted.begin() + new_len);
+    return llama_engine_session_append(engine, session, role, content);
+}
 
-    std::string response;
+int llama_session_truncate(int session, int n_messages) {
+    assert(engine != nullptr);
 
-    const bool is_first = llama_kv_self_seq_pos_max(ctx, 0) == 0;
+    return llama_engine_session_truncate(engine, session, n_messages);
+}
+
+int llama_session_start(int session, char * msgs) {
+    assert(engine != nullptr);
 
-    // tokenize the prompt
-    const int n_prompt_tokens = -llama_tokenize(vocab, prompt.c_str(), prompt.size(), NULL, 0, is_first, true);
-    std::vector<llama_token> prompt_tokens(n_prompt_tokens);
-    if (llama_tokenize(vocab, prompt.c_str(), prompt.size(), prompt_tokens.data(), prompt_tokens.size(), is_first, true) < 0) {
-        GGML_ABORT("failed to tokenize the prompt\n");
+    return llama_engine_session_start(engine, session, msgs);
+}
+
+int llama_session_poll_output(int session, char * buffer, int size) {
+    if (engine == nullptr) {
+        return -2;
     }
 
-    // prepare a batch for the prompt
-    llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
-    llama_token new_token_id;
-    while (!stop_generation.load()) {
-        // check if we have enough space in the context to evaluate this batch
-        int n_ctx = llama_n_ctx(ctx);
-        int n_ctx_used = llama_kv_self_seq_pos_max(ctx, 0);
-        if (n_ctx_used + batch.n_tokens > n_ctx) {
-            fprintf(stderr, "context size exceeded\n");
-            break;
-        }
-        
-        if (llama_decode(ctx, batch)) {
-            GGML_ABORT("failed to decode\n");
-        }
+    return llama_engine_session_poll(engine, session, buffer, size);
+}
 
-        // sample the next token
-        new_token_id = llama_sampler_sample(smpl, ctx, -1);
+void llama_session_set_progress(int session, dart_progress * progress) {
+    if (engine != nullptr) {
+        llama_engine_session_set_progress(engine, session, progress);
+    }
+}
 
-        // is it an end of generation?
-        if (llama_vocab_is_eog(vocab, new_token_id)) {
-            break;
-        }
+int llama_session_set_logprobs(int session, int n_top, dart_logprobs * logprobs) {
+    assert(engine != nullptr);
 
-        // convert the token to a string, print it and add it to the response
-        char buf[256];
-        int n = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, true);
-        if (n < 0) {
-            GGML_ABORT("failed to convert token to piece\n");
-        }
+    return llama_engine_session_set_logprobs(engine, session, n_top, logprobs);
+}
+
+int llama_session_set_sampler(int session, char * params) {
+    assert(engine != nullptr);
+
+    return llama_engine_session_set_sampler(engine, session, params);
+}
+
+char * llama_session_stats(int session) {
+    json stats = engine != nullptr ? llama_engine_session_stats(engine, session) : json::object();
 
-        std::string piece(buf, n);
-        output(piece.c_str());
-        response += piece;
+    return strdup(stats.dump().c_str());
+}
 
-        // prepare the next batch with the sampled token
-        batch = llama_batch_get_one(&new_token_id, 1);
+void llama_session_stop(int session) {
+    if (engine != nullptr) {
+        llama_engine_session_stop(engine, session);
     }
+}
+
+int llama_session_free(int session) {
+    assert(engine != nullptr);
+
+    return llama_engine_session_free(engine, session);
+}
+
+int llama_session_suspend(int session, char * path) {
+    assert(engine != nullptr);
+
+    return llama_engine_session_suspend(engine, session, path != nullptr ? path : "");
+}
+
+int llama_session_resume(int session, char * path) {
+    assert(engine != nullptr);
+
+    return llama_engine_session_resume(engine, session, path != nullptr ? path : "");
+}
+
+int llama_embed(char ** texts, int n_texts, float * embeddings, int normalize) {
+    assert(engine != nullptr);
 
-    // add the response to the messages
-    messages.push_back({"assistant", strdup(response.c_str())});
-    prev_len = llama_chat_apply_template(tmpl, messages.data(), messages.size(), false, nullptr, 0);
-    if (prev_len < 0) {
-        fprintf(stderr, "failed to apply the chat template\n");
+    return llama_engine_embed(engine, texts, n_texts, embeddings, normalize != 0);
+}
+
+int llama_embedding_size(void) {
+    assert(engine != nullptr);
+
+    return llama_model_n_embd(engine->model);
+}
+
+int llama_rerank(char * query, char ** passages, int n_passages, float * scores) {
+    assert(engine != nullptr);
+
+    return llama_engine_rerank(engine, query != nullptr ? query : "", passages, n_passages, scores);
+}
+
+int llama_loglikelihood(char * prompt, char ** candidates, int n_candidates, float * logprobs) {
+    assert(engine != nullptr);
+
+    return llama_engine_loglikelihood(engine, prompt != nullptr ? prompt : "", candidates, n_candidates, logprobs);
+}
+
+int llama_prompt_n(char * messages, int n, int n_predict, char ** replies) {
+    assert(engine != nullptr);
+
+    std::vector<std::string> texts;
+    if (llama_engine_prompt_n(engine, messages != nullptr ? messages : "[]", n, n_predict, texts) != 0) {
         return 1;
     }
-    
-    output(nullptr);
+
+    for (int i = 0; i < n; i++) {
+        replies[i] = strdup(texts[i].c_str());
+    }
+
     return 0;
 }
 
-void llama_llm_stop(void) {
-    stop_generation.store(true);
+static int vector_store_put(std::unique_ptr<llama_vector_store> store) {
+    std::lock_guard<std::mutex> lock(vector_stores_mutex);
+
+    const int id = next_vector_store++;
+    vector_stores[id] = std::move(store);
+
+    return id;
 }
 
-void llama_llm_free(void) {
-    llama_sampler_free(smpl);
-    llama_free(ctx);
-    llama_model_free(model);
+static std::shared_ptr<llama_vector_store> vector_store_get(int id) {
+    std::lock_guard<std::mutex> lock(vector_stores_mutex);
+
+    auto it = vector_stores.find(id);
+    if (it == vector_stores.end()) {
+        fprintf(stderr, "unknown vector store %d\n", id);
+        return nullptr;
+    }
+
+    return it->second;
+}
+
+int llama_vector_store_create(int dim, int quantize) {
+    if (dim <= 0) {
+        fprintf(stderr, "invalid vector width %d\n", dim);
+        return -1;
+    }
+
+    return vector_store_put(std::make_unique<llama_vector_store>(dim, quantize != 0));
+}
+
+int llama_vector_store_open(char * path) {
+    auto store = llama_vector_store::open(path != nullptr ? path : "");
+    if (store == nullptr) {
+        fprintf(stderr, "failed to open vector store %s\n", path != nullptr ? path : "");
+        return -1;
+    }
+
+    return vector_store_put(std::move(store));
+}
+
+int llama_vector_store_save(int id, char * path) {
+    auto store = vector_store_get(id);
+    if (store == nullptr) {
+        return 1;
+    }
+
+    return store->save(path != nullptr ? path : "") ? 0 : 1;
+}
+
+int llama_vector_store_dim(int id) {
+    auto store = vector_store_get(id);
+    if (store == nullptr) {
+        return -1;
+    }
+
+    return store->dim();
+}
+
+int llama_vector_store_size(int id) {
+    auto store = vector_store_get(id);
+    if (store == nullptr) {
+        return -1;
+    }
+
+    return store->size();
+}
+
+int llama_vector_store_add(int id, float * vectors, int64_t * ids, int n) {
+    auto store = vector_store_get(id);
+    if (store == nullptr || n < 0) {
+        return 1;
+    }
+
+    store->add(vectors, ids, n);
+    return 0;
+}
+
+int llama_vector_store_build_index(int id, int n_lists) {
+    auto store = vector_store_get(id);
+    if (store == nullptr || n_lists < 0) {
+        return 1;
+    }
+
+    return store->build_index(n_lists) ? 0 : 1;
+}
+
+int llama_vector_store_search(int id, float * query, int k, int n_probe, int64_t * ids, float * scores) {
+    auto store = vector_store_get(id);
+    if (store == nullptr || k < 0) {
+        return -1;
+    }
+
+    return store->search(query, k, n_probe > 0 ? n_probe : 1, ids, scores);
+}
+
+int llama_vector_store_free(int id) {
+    std::lock_guard<std::mutex> lock(vector_stores_mutex);
+
+    if (vector_stores.erase(id) == 0) {
+        fprintf(stderr, "unknown vector store %d\n", id);
+        return 1;
+    }
+
+    return 0;
 }
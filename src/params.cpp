@@ -1,5 +1,10 @@
 #include "params.hpp"
+#include "json_schema.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <vector>
 
 struct llama_model_params llama_model_params_from_json(json & params) {
@@ -58,6 +63,25 @@ struct llama_context_params llama_context_params_from_json(json & params) {
     if (params.contains("pooling_type") && params["pooling_type"].is_number_integer()) {
         context_params.pooling_type = params["pooling_type"];
     }
+    else if (params.contains("pooling_type") && params["pooling_type"].is_string()) {
+        // the controller sends the name of the PoolingType value
+        const std::string pooling_type = params["pooling_type"];
+        if (pooling_type == "none") {
+            context_params.pooling_type = LLAMA_POOLING_TYPE_NONE;
+        }
+        else if (pooling_type == "mean") {
+            context_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        }
+        else if (pooling_type == "cls") {
+            context_params.pooling_type = LLAMA_POOLING_TYPE_CLS;
+        }
+        else if (pooling_type == "last") {
+            context_params.pooling_type = LLAMA_POOLING_TYPE_LAST;
+        }
+        else if (pooling_type == "rank") {
+            context_params.pooling_type = LLAMA_POOLING_TYPE_RANK;
+        }
+    }
 
     if (params.contains("attention_type") && params["attention_type"].is_number_integer()) {
         context_params.attention_type = params["attention_type"];
@@ -114,12 +138,115 @@ struct llama_context_params llama_context_params_from_json(json & params) {
     return context_params;
 }
 
+// the tokens a logit_bias key or banned_tokens entry names: a token id, or the tokens of a text
+static bool bias_tokens(const llama_vocab * vocab, const json & key, std::vector<llama_token> & tokens) {
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    tokens.clear();
+
+    std::string text;
+    if (key.is_number_integer()) {
+        text = std::to_string(key.get<int64_t>());
+    }
+    else if (key.is_string()) {
+        text = key.get<std::string>();
+    }
+    else {
+        return false;
+    }
+
+    // object keys are always strings, so a key of digits alone is a token id, with a minus a bad one
+    const size_t n_sign = text.rfind('-', 0) == 0 ? 1 : 0;
+    if (text.size() > n_sign && text.find_first_not_of("0123456789", n_sign) == std::string::npos) {
+        const long long token = std::strtoll(text.c_str(), nullptr, 10);
+        if (token < 0 || token >= n_vocab) {
+            return false;
+        }
+
+        tokens.push_back(token);
+        return true;
+    }
+
+    const int n_tokens = -llama_tokenize(vocab, text.c_str(), text.size(), nullptr, 0, false, false);
+    tokens.resize(std::max(n_tokens, 0));
+    if (n_tokens <= 0 || llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), false, false) != n_tokens) {
+        return false;
+    }
+
+    return true;
+}
+
+// logit_bias and banned_tokens compiled into one list sorted by token, biases of the same token
+// summed and bans overriding them, so the sampler adds each entry once in memory order
+static bool logit_bias_from_json(const llama_vocab * vocab, json & params, std::vector<llama_logit_bias> & biases) {
+    std::vector<llama_token> tokens;
+    biases.clear();
+
+    if (params.contains("logit_bias") && params["logit_bias"].is_object()) {
+        for (auto & [key, bias] : params["logit_bias"].items()) {
+            if (!bias.is_number() || !bias_tokens(vocab, key, tokens)) {
+                fprintf(stderr, "invalid logit_bias entry %s\n", key.c_str());
+                return false;
+            }
+
+            for (auto token : tokens) {
+                biases.push_back({token, bias.get<float>()});
+            }
+        }
+    }
+
+    if (params.contains("banned_tokens") && params["banned_tokens"].is_array()) {
+        for (auto & key : params["banned_tokens"]) {
+            if (!bias_tokens(vocab, key, tokens)) {
+                fprintf(stderr, "invalid banned_tokens entry %s\n", key.dump().c_str());
+                return false;
+            }
+
+            for (auto token : tokens) {
+                biases.push_back({token, -INFINITY});
+            }
+        }
+    }
+
+    std::sort(biases.begin(), biases.end(), [](const llama_logit_bias & a, const llama_logit_bias & b) { return a.token < b.token; });
+
+    size_t n = 0;
+    for (size_t i = 0; i < biases.size(); i++) {
+        if (n > 0 && biases[n - 1].token == biases[i].token) {
+            biases[n - 1].bias += biases[i].bias;
+        }
+        else {
+            biases[n++] = biases[i];
+        }
+    }
+    biases.resize(n);
+
+    return true;
+}
+
 llama_sampler * llama_sampler_from_json(llama_model * model, json & params) {
     assert(model != nullptr);
 
     auto vocab = llama_model_get_vocab(model);
     auto sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
 
+    // first in the chain, while the candidates are still the whole vocabulary indexed by token id
+    std::vector<llama_logit_bias> biases;
+    if (!logit_bias_from_json(vocab, params, biases)) {
+        llama_sampler_free(sampler);
+        return nullptr;
+    }
+
+    if (!biases.empty()) {
+        llama_sampler_chain_add(
+            sampler,
+            llama_sampler_init_logit_bias(
+                llama_vocab_n_tokens(vocab),
+                biases.size(),
+                biases.data()
+            )
+        );
+    }
+
     if (
         params.contains("greedy") && 
         params["greedy"].is_boolean() && 
@@ -284,25 +411,6 @@ llama_sampler * llama_sampler_from_json(llama_model * model, json & params) {
         );
     }
 
-    if (
-        params.contains("grammar_str") && 
-        params["grammar_str"].is_string() &&
-        params.contains("grammar_root") &&
-        params["grammar_root"].is_string()
-    ) {
-        auto str = params["grammar_str"].get<std::string>();
-        auto root = params["grammar_root"].get<std::string>();
-
-        llama_sampler_chain_add(
-            sampler, 
-            llama_sampler_init_grammar(
-                vocab, 
-                str.c_str(),
-                root.c_str()
-            )
-        );
-    }
-
     if (
         params.contains("penalties_last_n") &&
         params["penalties_last_n"].is_number_integer() &&
@@ -360,4 +468,50 @@ llama_sampler * llama_sampler_from_json(llama_model * model, json & params) {
     }
 
     return sampler;
-}
\ No newline at end of file
+}
+
+bool llama_grammar_from_json(json & params, std::string & grammar, std::string & root) {
+    if (
+        params.contains("grammar_str") && 
+        params["grammar_str"].is_string() &&
+        params.contains("grammar_root") &&
+        params["grammar_root"].is_string()
+    ) {
+        grammar = params["grammar_str"].get<std::string>();
+        root = params["grammar_root"].get<std::string>();
+        return true;
+    }
+
+    // a schema may come as an object or as its json text
+    if (params.contains("json_schema") && (params["json_schema"].is_object() || params["json_schema"].is_string())) {
+        json schema = params["json_schema"].is_string() ? json::parse(params["json_schema"].get<std::string>(), nullptr, false) : params["json_schema"];
+
+        root = "root";
+        return llama_json_schema_to_grammar(schema, grammar);
+    }
+
+    return false;
+}
+
+bool llama_stop_from_json(json & params, std::vector<std::string> & stops) {
+    stops.clear();
+
+    // a single stop string may come bare
+    if (params.contains("stop") && params["stop"].is_string()) {
+        stops.push_back(params["stop"].get<std::string>());
+    }
+    else if (params.contains("stop") && params["stop"].is_array()) {
+        for (auto & stop : params["stop"]) {
+            if (!stop.is_string()) {
+                fprintf(stderr, "stop strings have to be strings\n");
+                return false;
+            }
+
+            stops.push_back(stop.get<std::string>());
+        }
+    }
+
+    // an empty stop string would end every reply before it began
+    stops.erase(std::remove(stops.begin(), stops.end(), std::string()), stops.end());
+    return true;
+}
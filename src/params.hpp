@@ -3,6 +3,8 @@
 
 #include "llama.h"
 #include "llama_cpp/vendor/nlohmann/json.hpp"
+#include <string>
+#include <vector>
 
 using json = nlohmann::ordered_json;
 
@@ -10,6 +12,16 @@ struct llama_model_params llama_model_params_from_json(json & params);
 
 struct llama_context_params llama_context_params_from_json(json & params);
 
+/// The chain of samplers the params ask for, without the grammar, which is
+/// sampled apart. nullptr if logit_bias or banned_tokens name an unknown token
 llama_sampler * llama_sampler_from_json(llama_model * model, json & params);
 
+/// The grammar the params ask for, from grammar_str and grammar_root or
+/// converted from json_schema. False if they ask for none or it is invalid
+bool llama_grammar_from_json(json & params, std::string & grammar, std::string & root);
+
+/// The stop strings the params ask for in stop, a string or an array of
+/// strings, empty strings are skipped. False if an entry is not a string
+bool llama_stop_from_json(json & params, std::vector<std::string> & stops);
+
 #endif
@@ -0,0 +1,103 @@
+#ifndef RING_HPP
+#define RING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/// Single producer, single consumer ring of length-prefixed byte records.
+/// The producer only moves head and the consumer only moves tail, so
+/// neither side takes a lock or waits for the other.
+struct llama_output_ring {
+    std::vector<char> data;
+    size_t mask = 0;
+
+    alignas(64) std::atomic<size_t> head{0}; // next byte the producer writes
+    alignas(64) std::atomic<size_t> tail{0}; // next byte the consumer reads
+
+    /// Not thread safe, only call while neither side is using the ring
+    void init(size_t capacity) {
+        size_t size = 64;
+        while (size < capacity) {
+            size <<= 1;
+        }
+
+        data.assign(size, 0);
+        mask = size - 1;
+        head.store(0);
+        tail.store(0);
+    }
+
+    size_t capacity() const {
+        return data.size();
+    }
+
+    /// Producer side: bytes a push can use, including the record header
+    size_t space() const {
+        return data.size() - (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire));
+    }
+
+    /// Producer side: appends a record, false if it does not fit
+    bool push(const char * bytes, uint16_t n) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (data.size() - (h - tail.load(std::memory_order_acquire)) < sizeof(n) + n) {
+            return false;
+        }
+
+        copy_in(h, (const char *) &n, sizeof(n));
+        copy_in(h + sizeof(n), bytes, n);
+        head.store(h + sizeof(n) + n, std::memory_order_release);
+
+        return true;
+    }
+
+    /// Consumer side: drops everything written so far, the producer must be idle
+    void discard() {
+        tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    /// Consumer side
+    bool empty() const {
+        return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+    }
+
+    /// Consumer side: appends the next record to out, false if there is none
+    bool pop(std::string & out) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        uint16_t n;
+        copy_out(t, (char *) &n, sizeof(n));
+
+        const size_t offset = out.size();
+        out.resize(offset + n);
+        copy_out(t + sizeof(n), out.data() + offset, n);
+
+        tail.store(t + sizeof(n) + n, std::memory_order_release);
+
+        return true;
+    }
+
+private:
+    void copy_in(size_t pos, const char * src, size_t n) {
+        const size_t i = pos & mask;
+        const size_t first = std::min(n, data.size() - i);
+        memcpy(data.data() + i, src, first);
+        memcpy(data.data(), src + first, n - first);
+    }
+
+    void copy_out(size_t pos, char * dst, size_t n) const {
+        const size_t i = pos & mask;
+        const size_t first = std::min(n, data.size() - i);
+        memcpy(dst, data.data() + i, first);
+        memcpy(dst + first, data.data(), n - first);
+    }
+};
+
+#endif
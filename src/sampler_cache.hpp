@@ -0,0 +1,197 @@
+#ifndef SAMPLER_CACHE_HPP
+#define SAMPLER_CACHE_HPP
+
+#include "hash.hpp"
+#include "llama.h"
+#include "params.hpp"
+#include "stop.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/// Sampler chains built from the init parameters with a json object of sampler
+/// parameters laid over them, keyed by the text of that object. The grammar of
+/// a chain is kept apart from it, parsed once and shared by every chain asking
+/// for the same grammar. Holds at most capacity chains, the least recently
+/// used are dropped first. The stop strings of an entry are compiled once into
+/// an automaton shared by every session using it. The chains are never sampled
+/// with, callers get clones in their initial state. A chain with no sampler
+/// that picks the token gets a dist sampler of its own in every clone, seeded
+/// apart, so sessions do not replay each other's draws. Thread safe, chains are
+/// built without holding the mutex.
+struct llama_sampler_cache {
+    size_t capacity = 16;
+
+    ~llama_sampler_cache() {
+        for (auto & entry : lru) {
+            release(entry);
+        }
+    }
+
+    /// A new chain for the sampler parameters in text, an empty text keeps the
+    /// init parameters, its grammar in grammar, nullptr if it has none, and its
+    /// stop strings in stop, nullptr if it has none. nullptr if text is not a
+    /// json object, the grammar is invalid or a stop string is not a string
+    llama_sampler * clone(
+        llama_model * model,
+        const json & base,
+        const std::string & text,
+        llama_sampler ** grammar,
+        std::shared_ptr<const llama_stop_automaton> * stop
+    ) {
+        const uint64_t key = fnv1a_hash(text);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            auto it = index.find(key);
+            if (it != index.end() && it->second->text == text) {
+                lru.splice(lru.begin(), lru, it->second);
+                *grammar = it->second->grammar != nullptr ? llama_sampler_clone(it->second->grammar) : nullptr;
+                *stop = it->second->stop;
+                return instance(*it->second);
+            }
+        }
+
+        json params = base;
+        if (!text.empty()) {
+            json overrides = json::parse(text, nullptr, false);
+            if (!overrides.is_object()) {
+                fprintf(stderr, "the sampler parameters have to be a json object\n");
+                return nullptr;
+            }
+
+            params.update(overrides);
+        }
+
+        entry built = {key, text, nullptr, false, nullptr, 0, nullptr};
+
+        std::vector<std::string> stops;
+        if (!llama_stop_from_json(params, stops)) {
+            return nullptr;
+        }
+
+        if (!stops.empty()) {
+            built.stop = std::make_shared<const llama_stop_automaton>(stops);
+        }
+
+        std::string str;
+        std::string root;
+        if (llama_grammar_from_json(params, str, root)) {
+            built.grammar_key = fnv1a_hash(root, fnv1a_hash(str + '\0'));
+            built.grammar = shared_grammar(built.grammar_key);
+
+            if (built.grammar == nullptr) {
+                built.grammar = llama_sampler_init_grammar(llama_model_get_vocab(model), str.c_str(), root.c_str());
+            }
+
+            if (built.grammar == nullptr) {
+                fprintf(stderr, "failed to parse the grammar\n");
+                return nullptr;
+            }
+        }
+        else if (params.contains("json_schema") && !params["json_schema"].is_null()) {
+            return nullptr;
+        }
+
+        built.smpl = llama_sampler_from_json(model, params);
+        if (built.smpl == nullptr) {
+            if (built.grammar != nullptr) {
+                llama_sampler_free(built.grammar);
+            }
+            return nullptr;
+        }
+
+        built.unseeded = !picks_token(built.smpl);
+
+        llama_sampler * copy = instance(built);
+        *grammar = built.grammar != nullptr ? llama_sampler_clone(built.grammar) : nullptr;
+        *stop = built.stop;
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // built twice by racing callers, or a hash collision, the newer chain wins
+        auto it = index.find(key);
+        if (it != index.end()) {
+            release(*it->second);
+            lru.erase(it->second);
+            index.erase(it);
+        }
+
+        lru.push_front(built);
+        index[key] = lru.begin();
+
+        while (lru.size() > std::max<size_t>(capacity, 1)) {
+            release(lru.back());
+            index.erase(lru.back().key);
+            lru.pop_back();
+        }
+
+        return copy;
+    }
+
+private:
+    struct entry {
+        uint64_t key;
+        std::string text;
+        llama_sampler * smpl;
+        bool unseeded;           // no sampler of smpl picks the token, clones get a dist sampler
+        llama_sampler * grammar; // parsed once, cloned for the chains that share it
+        uint64_t grammar_key;
+        std::shared_ptr<const llama_stop_automaton> stop;
+    };
+
+    // whether a sampler of the chain selects the token, a chain without one ends in a fresh dist sampler
+    static bool picks_token(llama_sampler * chain) {
+        for (int i = 0; i < llama_sampler_chain_n(chain); i++) {
+            const std::string name = llama_sampler_name(llama_sampler_chain_get(chain, i));
+            if (name == "greedy" || name == "dist" || name == "mirostat" || name == "mirostat-v2") {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // a clone of the chain of e, LLAMA_DEFAULT_SEED has dist draw a random seed for each one
+    static llama_sampler * instance(const entry & e) {
+        llama_sampler * smpl = llama_sampler_clone(e.smpl);
+        if (e.unseeded) {
+            llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+        }
+
+        return smpl;
+    }
+
+    static void release(entry & e) {
+        llama_sampler_free(e.smpl);
+        if (e.grammar != nullptr) {
+            llama_sampler_free(e.grammar);
+        }
+    }
+
+    // a clone of a cached grammar parsed from the same text, nullptr if there is none
+    llama_sampler * shared_grammar(uint64_t grammar_key) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for (auto & e : lru) {
+            if (e.grammar != nullptr && e.grammar_key == grammar_key) {
+                return llama_sampler_clone(e.grammar);
+            }
+        }
+
+        return nullptr;
+    }
+
+    std::mutex mutex;
+    std::list<entry> lru;
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+};
+
+#endif
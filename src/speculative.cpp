@@ -0,0 +1,288 @@
+#include "speculative.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+int llama_ngram_draft(const std::vector<llama_token> & tokens, llama_token last, int n_min, int n_max, int n_draft, std::vector<llama_token> & draft) {
+    draft.clear();
+
+    const int n_seq = tokens.size() + 1;
+    auto at = [&](int i) { return i < (int) tokens.size() ? tokens[i] : last; };
+
+    if (n_draft <= 0) {
+        return 0;
+    }
+
+    for (int n = std::min(n_max, n_seq - 1); n >= std::max(n_min, 1); n--) {
+        const int pattern = n_seq - n;
+
+        // the most recent match wins, it is the most likely to be continued the same way
+        for (int i = pattern - 1; i >= 0; i--) {
+            int k = 0;
+            while (k < n && at(i + k) == at(pattern + k)) {
+                k++;
+            }
+
+            if (k < n) {
+                continue;
+            }
+
+            const int end = std::min(i + n + n_draft, n_seq);
+            for (int j = i + n; j < end; j++) {
+                draft.push_back(at(j));
+            }
+
+            return draft.size();
+        }
+    }
+
+    return 0;
+}
+
+// the draft and target vocabularies differ by at most this many tokens
+#define DRAFT_VOCAB_MAX_SIZE_DIFFERENCE 128
+
+// the first few ids are often special tokens that are allowed to differ
+#define DRAFT_VOCAB_CHECK_START_TOKEN_ID 5
+
+static bool draft_compatible(const llama_model * target, const llama_model * draft) {
+    auto vocab_tgt = llama_model_get_vocab(target);
+    auto vocab_dft = llama_model_get_vocab(draft);
+
+    if (llama_vocab_type(vocab_tgt) != llama_vocab_type(vocab_dft)) {
+        fprintf(stderr, "draft model vocab type differs from the target's\n");
+        return false;
+    }
+
+    if (
+        llama_vocab_get_add_bos(vocab_tgt) != llama_vocab_get_add_bos(vocab_dft) ||
+        llama_vocab_get_add_eos(vocab_tgt) != llama_vocab_get_add_eos(vocab_dft) ||
+        llama_vocab_bos(vocab_tgt) != llama_vocab_bos(vocab_dft) ||
+        llama_vocab_eos(vocab_tgt) != llama_vocab_eos(vocab_dft)
+    ) {
+        fprintf(stderr, "draft model special tokens differ from the target's\n");
+        return false;
+    }
+
+    const int n_vocab_tgt = llama_vocab_n_tokens(vocab_tgt);
+    const int n_vocab_dft = llama_vocab_n_tokens(vocab_dft);
+
+    if (std::abs(n_vocab_tgt - n_vocab_dft) > DRAFT_VOCAB_MAX_SIZE_DIFFERENCE) {
+        fprintf(stderr, "draft model vocab size %d is too different from the target's %d\n", n_vocab_dft, n_vocab_tgt);
+        return false;
+    }
+
+    for (int i = DRAFT_VOCAB_CHECK_START_TOKEN_ID; i < std::min(n_vocab_tgt, n_vocab_dft); i++) {
+        if (strcmp(llama_vocab_get_text(vocab_tgt, i), llama_vocab_get_text(vocab_dft, i)) != 0) {
+            fprintf(stderr, "draft model token %d '%s' differs from the target's '%s'\n", i, llama_vocab_get_text(vocab_dft, i), llama_vocab_get_text(vocab_tgt, i));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+llama_draft * llama_draft_init(const std::string & path, json & params, const llama_model * target, const llama_context * target_ctx) {
+    auto model_params = llama_model_params_from_json(params);
+
+    auto model = llama_model_load_from_file(path.c_str(), model_params);
+    if (model == nullptr) {
+        fprintf(stderr, "failed to load draft model %s\n", path.c_str());
+        return nullptr;
+    }
+
+    if (!draft_compatible(target, model)) {
+        llama_model_free(model);
+        return nullptr;
+    }
+
+    // the draft mirrors every target sequence, so it needs the same shape of context
+    auto context_params = llama_context_params_from_json(params);
+    context_params.n_ctx = llama_n_ctx(target_ctx);
+    context_params.n_batch = llama_n_batch(target_ctx);
+    context_params.n_ubatch = llama_n_ubatch(target_ctx);
+    context_params.n_seq_max = llama_n_seq_max(target_ctx);
+    context_params.embeddings = false;
+
+    auto ctx = llama_init_from_model(model, context_params);
+    if (ctx == nullptr) {
+        fprintf(stderr, "failed to create the draft model context\n");
+        llama_model_free(model);
+        return nullptr;
+    }
+
+    auto draft = new llama_draft();
+    draft->model = model;
+    draft->ctx = ctx;
+    draft->batch = llama_batch_init(context_params.n_batch, 0, 1);
+    draft->tokens.resize(context_params.n_seq_max);
+
+    if (params.contains("draft_p_min") && params["draft_p_min"].is_number()) {
+        draft->p_min = params["draft_p_min"];
+    }
+
+    return draft;
+}
+
+void llama_draft_free(llama_draft * draft) {
+    llama_batch_free(draft->batch);
+    llama_free(draft->ctx);
+    llama_model_free(draft->model);
+
+    delete draft;
+}
+
+static void batch_add(llama_batch & batch, llama_token token, llama_pos pos, llama_seq_id seq_id, bool logits) {
+    batch.token[batch.n_tokens] = token;
+    batch.pos[batch.n_tokens] = pos;
+    batch.n_seq_id[batch.n_tokens] = 1;
+    batch.seq_id[batch.n_tokens][0] = seq_id;
+    batch.logits[batch.n_tokens] = logits;
+    batch.n_tokens++;
+}
+
+// the most likely token and its probability
+static llama_token draft_top(const float * logits, int n_vocab, float & p) {
+    llama_token top = 0;
+    for (int i = 1; i < n_vocab; i++) {
+        if (logits[i] > logits[top]) {
+            top = i;
+        }
+    }
+
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; i++) {
+        sum += std::exp(logits[i] - logits[top]);
+    }
+
+    p = 1.0 / sum;
+    return top;
+}
+
+void llama_draft_generate(llama_draft * draft, std::vector<llama_draft_request> & requests) {
+    auto & batch = draft->batch;
+    const int n_batch = llama_n_batch(draft->ctx);
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(draft->model));
+
+    // logits index of each request in the last draft batch, -1 once it is done drafting
+    std::vector<int> i_logits(requests.size(), -1);
+    std::vector<size_t> n_fed(requests.size());
+
+    auto reset = [&](size_t i) {
+        llama_kv_self_seq_rm(draft->ctx, requests[i].seq_id, -1, -1);
+        draft->tokens[requests[i].seq_id].clear();
+        i_logits[i] = -1;
+    };
+
+    // drop what the target has rejected or rewritten, keep the common prefix
+    for (size_t i = 0; i < requests.size(); i++) {
+        auto & req = requests[i];
+        auto & resident = draft->tokens[req.seq_id];
+
+        req.draft->clear();
+
+        size_t n_keep = 0;
+        while (n_keep < resident.size() && n_keep < req.tokens->size() && resident[n_keep] == (*req.tokens)[n_keep]) {
+            n_keep++;
+        }
+
+        llama_kv_self_seq_rm(draft->ctx, req.seq_id, n_keep, -1);
+        resident.resize(n_keep);
+        n_fed[i] = n_keep;
+    }
+
+    // catch up on the target's tokens, as many batches as it takes
+    while (true) {
+        batch.n_tokens = 0;
+
+        for (size_t i = 0; i < requests.size(); i++) {
+            auto & req = requests[i];
+            auto & resident = draft->tokens[req.seq_id];
+
+            while (n_fed[i] < req.tokens->size() && batch.n_tokens < n_batch) {
+                batch_add(batch, (*req.tokens)[n_fed[i]], resident.size(), req.seq_id, false);
+                resident.push_back((*req.tokens)[n_fed[i]]);
+                n_fed[i]++;
+            }
+        }
+
+        if (batch.n_tokens == 0) {
+            break;
+        }
+
+        if (llama_decode(draft->ctx, batch) != 0) {
+            fprintf(stderr, "failed to decode the draft batch\n");
+            for (size_t i = 0; i < requests.size(); i++) {
+                reset(i);
+            }
+            return;
+        }
+    }
+
+    // the sampled tokens go in last so all their logits come out of the same batch
+    batch.n_tokens = 0;
+
+    for (size_t i = 0; i < requests.size(); i++) {
+        auto & req = requests[i];
+        auto & resident = draft->tokens[req.seq_id];
+
+        batch_add(batch, req.last, resident.size(), req.seq_id, true);
+        resident.push_back(req.last);
+        i_logits[i] = batch.n_tokens - 1;
+    }
+
+    if (llama_decode(draft->ctx, batch) != 0) {
+        fprintf(stderr, "failed to decode the draft batch\n");
+        for (size_t i = 0; i < requests.size(); i++) {
+            reset(i);
+        }
+        return;
+    }
+
+    // draft one position for every request per decode until they are all done
+    while (true) {
+        batch.n_tokens = 0;
+
+        for (size_t i = 0; i < requests.size(); i++) {
+            auto & req = requests[i];
+            if (i_logits[i] < 0) {
+                continue;
+            }
+
+            float p = 0.0f;
+            const llama_token token = draft_top(llama_get_logits_ith(draft->ctx, i_logits[i]), n_vocab, p);
+            i_logits[i] = -1;
+
+            if (p < draft->p_min) {
+                continue;
+            }
+
+            req.draft->push_back(token);
+
+            // the last draft token is decoded by the target, not the draft
+            if ((int) req.draft->size() >= req.n_draft) {
+                continue;
+            }
+
+            auto & resident = draft->tokens[req.seq_id];
+            batch_add(batch, token, resident.size(), req.seq_id, true);
+            resident.push_back(token);
+            i_logits[i] = batch.n_tokens - 1;
+        }
+
+        if (batch.n_tokens == 0) {
+            break;
+        }
+
+        if (llama_decode(draft->ctx, batch) != 0) {
+            fprintf(stderr, "failed to decode the draft batch\n");
+            for (size_t i = 0; i < requests.size(); i++) {
+                if (i_logits[i] >= 0) {
+                    reset(i);
+                }
+            }
+            return;
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef SPECULATIVE_HPP
+#define SPECULATIVE_HPP
+
+#include "llama.h"
+#include "params.hpp"
+#include <string>
+#include <vector>
+
+/// Prompt lookup drafting: finds the most recent earlier occurrence of the
+/// last n tokens of the sequence (tokens followed by last), trying n from
+/// n_max down to n_min, and proposes up to n_draft tokens that followed it.
+/// Returns the number of tokens written to draft.
+int llama_ngram_draft(const std::vector<llama_token> & tokens, llama_token last, int n_min, int n_max, int n_draft, std::vector<llama_token> & draft);
+
+/// A small model sharing the target's vocabulary, with one sequence per
+/// target sequence so every session drafts from its own history.
+struct llama_draft {
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+    llama_batch batch = {};
+    float p_min = 0.75f; // stop drafting once the draft model is less sure than this
+
+    std::vector<std::vector<llama_token>> tokens; // tokens resident in each draft sequence
+};
+
+struct llama_draft_request {
+    llama_seq_id seq_id;
+    const std::vector<llama_token> * tokens; // the target sequence
+    llama_token last;                        // sampled by the target, not decoded yet
+    int n_draft;
+    std::vector<llama_token> * draft;
+};
+
+/// Loads the draft model at path with a context matching target_ctx, or
+/// returns nullptr if it cannot be loaded or its vocabulary differs from
+/// the target's.
+llama_draft * llama_draft_init(const std::string & path, json & params, const llama_model * target, const llama_context * target_ctx);
+
+void llama_draft_free(llama_draft * draft);
+
+/// Drafts for all requests at once, one draft decode per drafted position.
+/// Each draft sequence is first brought in line with its target sequence,
+/// reusing whatever prefix it already holds.
+void llama_draft_generate(llama_draft * draft, std::vector<llama_draft_request> & requests);
+
+#endif
@@ -0,0 +1,169 @@
+#include "state.hpp"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#if !defined(_WIN32)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+static const uint32_t STATE_MAGIC = 0x4b44534c; // 'LSDK'
+static const uint32_t STATE_VERSION = 1;
+
+struct state_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_tokens;
+    uint32_t reserved;
+    uint64_t n_data;
+};
+
+llama_seq_state_file::~llama_seq_state_file() {
+#if !defined(_WIN32)
+    if (addr != nullptr) {
+        munmap(addr, length);
+    }
+#endif
+}
+
+static bool state_parse(llama_seq_state_file & file, const uint8_t * base, size_t length) {
+    state_header header;
+    if (length < sizeof(header)) {
+        return false;
+    }
+
+    memcpy(&header, base, sizeof(header));
+    if (header.magic != STATE_MAGIC || header.version != STATE_VERSION) {
+        return false;
+    }
+
+    // each field is bounded by what is left of the file, so a crafted one cannot wrap the sum
+    const size_t n_left = length - sizeof(header);
+    if (header.n_tokens > n_left / sizeof(llama_token)) {
+        return false;
+    }
+
+    const size_t n_token_bytes = header.n_tokens * sizeof(llama_token);
+    if (header.n_data != n_left - n_token_bytes) {
+        return false;
+    }
+
+    file.tokens.resize(header.n_tokens);
+    memcpy(file.tokens.data(), base + sizeof(header), n_token_bytes);
+
+    file.data = base + sizeof(header) + n_token_bytes;
+    file.size = header.n_data;
+
+    return true;
+}
+
+std::unique_ptr<llama_seq_state_file> llama_seq_state_open(const std::string & path) {
+    auto file = std::make_unique<llama_seq_state_file>();
+
+#if defined(_WIN32)
+    std::ifstream in(std::filesystem::u8path(path), std::ios::binary | std::ios::ate);
+    if (!in) {
+        return nullptr;
+    }
+
+    file->buffer.resize(in.tellg());
+    in.seekg(0);
+    if (!in.read((char *) file->buffer.data(), file->buffer.size())) {
+        return nullptr;
+    }
+
+    if (!state_parse(*file, file->buffer.data(), file->buffer.size())) {
+        fprintf(stderr, "invalid state file %s\n", path.c_str());
+        return nullptr;
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    file->length = st.st_size;
+    file->addr = mmap(nullptr, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (file->addr == MAP_FAILED) {
+        file->addr = nullptr;
+        return nullptr;
+    }
+
+    if (!state_parse(*file, (const uint8_t *) file->addr, file->length)) {
+        fprintf(stderr, "invalid state file %s\n", path.c_str());
+        return nullptr;
+    }
+#endif
+
+    return file;
+}
+
+bool llama_seq_state_write(const std::string & path, const std::vector<llama_token> & tokens, const std::vector<uint8_t> & data) {
+    state_header header = { STATE_MAGIC, STATE_VERSION, (uint32_t) tokens.size(), 0, data.size() };
+
+    // write next to the target and rename so readers never see a partial file
+    const std::string tmp_path = path + ".tmp";
+
+    {
+        std::ofstream out(std::filesystem::u8path(tmp_path), std::ios::binary | std::ios::trunc);
+        if (!out) {
+            fprintf(stderr, "failed to open %s for writing\n", tmp_path.c_str());
+            return false;
+        }
+
+        out.write((const char *) &header, sizeof(header));
+        out.write((const char *) tokens.data(), tokens.size() * sizeof(llama_token));
+        out.write((const char *) data.data(), data.size());
+
+        if (!out) {
+            fprintf(stderr, "failed to write %s\n", tmp_path.c_str());
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(std::filesystem::u8path(tmp_path), std::filesystem::u8path(path), ec);
+    if (ec) {
+        fprintf(stderr, "failed to rename %s: %s\n", tmp_path.c_str(), ec.message().c_str());
+        std::filesystem::remove(std::filesystem::u8path(tmp_path), ec);
+        return false;
+    }
+
+    return true;
+}
+
+bool llama_seq_state_get(llama_context * ctx, llama_seq_id seq_id, std::vector<uint8_t> & data) {
+    data.resize(llama_state_seq_get_size(ctx, seq_id));
+
+    const size_t n_written = llama_state_seq_get_data(ctx, data.data(), data.size(), seq_id);
+    if (n_written == 0) {
+        data.clear();
+        return false;
+    }
+
+    data.resize(n_written);
+    return true;
+}
+
+bool llama_seq_state_set(llama_context * ctx, llama_seq_id seq_id, const llama_seq_state_file & file) {
+    llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+
+    if (llama_state_seq_set_data(ctx, file.data, file.size, seq_id) == 0) {
+        llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+        return false;
+    }
+
+    return true;
+}
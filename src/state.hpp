@@ -0,0 +1,34 @@
+#ifndef STATE_HPP
+#define STATE_HPP
+
+#include "llama.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+/// A sequence state file: the tokens of the sequence followed by the
+/// llama_state_seq_get_data blob. Opened files are memory-mapped where
+/// available so restoring does not copy the state through a buffer.
+struct llama_seq_state_file {
+    std::vector<llama_token> tokens;
+    const uint8_t * data = nullptr;
+    size_t size = 0;
+
+    void * addr = nullptr;
+    size_t length = 0;
+    std::vector<uint8_t> buffer;
+
+    ~llama_seq_state_file();
+};
+
+std::unique_ptr<llama_seq_state_file> llama_seq_state_open(const std::string & path);
+
+bool llama_seq_state_write(const std::string & path, const std::vector<llama_token> & tokens, const std::vector<uint8_t> & data);
+
+/// Copies the state of seq_id into data, the caller must own the context
+bool llama_seq_state_get(llama_context * ctx, llama_seq_id seq_id, std::vector<uint8_t> & data);
+
+/// Restores an opened file into seq_id, the caller must own the context
+bool llama_seq_state_set(llama_context * ctx, llama_seq_id seq_id, const llama_seq_state_file & file);
+
+#endif
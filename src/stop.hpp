@@ -0,0 +1,98 @@
+#ifndef STOP_HPP
+#define STOP_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Aho-Corasick automaton over the bytes of a set of stop strings. Text is fed
+/// a byte at a time, the state then tells whether a stop string just ended and
+/// how many of the last bytes could still begin one. Immutable once built, so
+/// one automaton is shared by every session that stops on the same strings.
+struct llama_stop_automaton {
+    size_t max_length = 0; // bytes of the longest stop string
+
+    explicit llama_stop_automaton(const std::vector<std::string> & stops) {
+        // the trie, with the transitions of missing edges left at -1
+        add_state(0);
+        for (auto & stop : stops) {
+            int32_t state = 0;
+            for (unsigned char c : stop) {
+                if (delta[state * 256 + c] < 0) {
+                    delta[state * 256 + c] = n_states();
+                    add_state(depths[state] + 1);
+                }
+                state = delta[state * 256 + c];
+            }
+
+            matches[state] = std::max<uint32_t>(matches[state], stop.size());
+            max_length = std::max(max_length, stop.size());
+        }
+
+        // breadth first, so the failure state of each state is complete before it is needed; missing
+        // edges take the edge of the failure state, which turns the trie into a full transition table
+        std::vector<int32_t> fail(n_states(), 0);
+        std::vector<int32_t> queue;
+
+        for (int c = 0; c < 256; c++) {
+            int32_t & next = delta[c];
+            if (next < 0) {
+                next = 0;
+            }
+            else {
+                queue.push_back(next);
+            }
+        }
+
+        for (size_t i = 0; i < queue.size(); i++) {
+            const int32_t state = queue[i];
+
+            // a stop string that ends in a suffix of this state ends here as well
+            matches[state] = std::max(matches[state], matches[fail[state]]);
+
+            for (int c = 0; c < 256; c++) {
+                int32_t & next = delta[state * 256 + c];
+                if (next < 0) {
+                    next = delta[fail[state] * 256 + c];
+                }
+                else {
+                    fail[next] = delta[fail[state] * 256 + c];
+                    queue.push_back(next);
+                }
+            }
+        }
+    }
+
+    int32_t next(int32_t state, unsigned char c) const {
+        return delta[state * 256 + c];
+    }
+
+    /// Bytes of the longest stop string that ends at state, 0 if none does
+    uint32_t match(int32_t state) const {
+        return matches[state];
+    }
+
+    /// Bytes at the end of the text that could still begin a stop string
+    uint32_t depth(int32_t state) const {
+        return depths[state];
+    }
+
+private:
+    std::vector<int32_t> delta; // 256 transitions per state
+    std::vector<uint32_t> depths;
+    std::vector<uint32_t> matches;
+
+    int32_t n_states() const {
+        return depths.size();
+    }
+
+    void add_state(uint32_t depth) {
+        delta.resize(delta.size() + 256, -1);
+        depths.push_back(depth);
+        matches.push_back(0);
+    }
+};
+
+#endif
@@ -0,0 +1,153 @@
+// the grammar a schema converts to, rule by rule
+#undef NDEBUG
+#include "json_schema.hpp"
+#include <cassert>
+#include <cctype>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+
+// name ::= body of every rule, and checks that every rule is defined once, referenced rules exist
+// and none is left unreferenced
+static std::map<std::string, std::string> convert(const char * schema) {
+    std::string grammar;
+    assert(llama_json_schema_to_grammar(json::parse(schema), grammar));
+
+    std::map<std::string, std::string> rules;
+    std::set<std::string> used = {"root"};
+
+    size_t pos = 0;
+    while (pos < grammar.size()) {
+        const size_t eol = grammar.find('\n', pos);
+        const std::string line = grammar.substr(pos, eol - pos);
+        pos = eol + 1;
+
+        const size_t sep = line.find(" ::= ");
+        assert(sep != std::string::npos);
+
+        const std::string name = line.substr(0, sep);
+        const std::string body = line.substr(sep + 5);
+        assert(rules.count(name) == 0);
+        rules[name] = body;
+
+        // rule names outside of literals and character classes
+        for (size_t i = 0; i < body.size(); i++) {
+            if (body[i] == '"' || body[i] == '[') {
+                const char end = body[i] == '"' ? '"' : ']';
+                for (i++; i < body.size() && body[i] != end; i++) {
+                    i += body[i] == '\\';
+                }
+            }
+            else if (isalpha((unsigned char) body[i])) {
+                size_t j = i;
+                while (j < body.size() && (isalnum((unsigned char) body[j]) || body[j] == '-')) {
+                    j++;
+                }
+                used.insert(body.substr(i, j - i));
+                i = j - 1;
+            }
+        }
+    }
+
+    for (auto & name : used) {
+        assert(rules.count(name) > 0);
+    }
+    for (auto & [name, body] : rules) {
+        assert(used.count(name) > 0);
+    }
+
+    return rules;
+}
+
+static void test_required_and_optional() {
+    auto rules = convert(R"({
+        "type": "object",
+        "properties": {"a": {"type": "integer"}, "b": {"type": "string"}, "c": {"type": "boolean"}},
+        "required": ["b"]
+    })");
+
+    // the required key comes first, the optional ones follow in order, each after a comma
+    assert(rules["root"] == "\"{\" space root-b-kv root-opt-0 \"}\" space");
+    assert(rules["root-b-kv"] == "\"\\\"b\\\"\" space \":\" space string");
+    assert(rules["root-opt-0"] == "( \",\" space root-a-kv )? root-opt-1");
+    assert(rules["root-opt-1"] == "( \",\" space root-c-kv )?");
+}
+
+static void test_optional_only() {
+    auto rules = convert(R"({
+        "type": "object",
+        "properties": {"a": {"type": "integer"}, "b": {"type": "integer"}}
+    })");
+
+    // the first key present takes no comma, and no rule is built for a comma before the first key
+    assert(rules["root"] == "\"{\" space ( root-a-kv root-opt-1 | root-b-kv )? \"}\" space");
+    assert(rules.count("root-opt-0") == 0);
+}
+
+static void test_enum_and_const() {
+    auto rules = convert(R"({
+        "type": "object",
+        "properties": {"color": {"enum": ["red", "green", 1, null]}, "kind": {"const": "point"}},
+        "required": ["color", "kind"]
+    })");
+
+    assert(rules["root-color"] == "(\"\\\"red\\\"\" | \"\\\"green\\\"\" | \"1\" | \"null\") space");
+    assert(rules["root-kind"] == "\"\\\"point\\\"\" space");
+}
+
+static void test_arrays() {
+    auto rules = convert(R"({
+        "type": "object",
+        "properties": {
+            "tags": {"type": "array", "items": {"type": "string"}, "minItems": 1, "maxItems": 3},
+            "any": {"type": "array", "items": {"type": "integer"}},
+            "pair": {"type": "array", "prefixItems": [{"type": "integer"}, {"type": "boolean"}]}
+        },
+        "required": ["tags", "any", "pair"]
+    })");
+
+    assert(rules["root-tags"] == "\"[\" space string ( \",\" space string ){0,2} \"]\" space");
+    assert(rules["root-any"] == "\"[\" space ( integer ( \",\" space integer )* )? \"]\" space");
+    assert(rules["root-pair"] == "\"[\" space integer \",\" space boolean \"]\" space");
+}
+
+static void test_refs() {
+    auto rules = convert(R"({
+        "type": "object",
+        "properties": {
+            "x": {"$ref": "#/$defs/a/item"},
+            "y": {"$ref": "#/$defs/b/item"},
+            "next": {"$ref": "#/$defs/node"}
+        },
+        "required": ["x", "y", "next"],
+        "$defs": {
+            "a": {"item": {"type": "string"}},
+            "b": {"item": {"type": "integer"}},
+            "node": {"type": "object", "properties": {"next": {"$ref": "#/$defs/node"}}}
+        }
+    })");
+
+    // refs ending in the same segment get rules of their own, a recursive one refers to itself
+    assert(rules["ref-item"] == "string");
+    assert(rules["ref-item1"] == "integer");
+    assert(rules["ref-node-body-next-kv"] == "\"\\\"next\\\"\" space \":\" space ref-node");
+}
+
+static void test_unsupported() {
+    std::string grammar;
+    assert(!llama_json_schema_to_grammar(json::parse(R"({"$ref": "https://example.com/schema"})"), grammar));
+    assert(!llama_json_schema_to_grammar(json::parse(R"({"type": "date"})"), grammar));
+}
+
+int main() {
+    test_required_and_optional();
+    test_optional_only();
+    test_enum_and_const();
+    test_arrays();
+    test_refs();
+    test_unsupported();
+
+    printf("test_json_schema: ok\n");
+    return 0;
+}
@@ -0,0 +1,101 @@
+// records go through the output ring whole and in order, across the wrap and between threads
+#undef NDEBUG
+#include "ring.hpp"
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+static void test_capacity() {
+    llama_output_ring ring;
+
+    ring.init(100);
+    assert(ring.capacity() == 128);
+
+    ring.init(1);
+    assert(ring.capacity() == 64);
+}
+
+static void test_wrap() {
+    llama_output_ring ring;
+    ring.init(64);
+
+    // records of 2 + 10 bytes do not divide 64, so they soon straddle the end of the buffer
+    std::string out;
+    for (int i = 0; i < 100; i++) {
+        const std::string record = "record " + std::to_string(i % 10) + "..";
+        assert(ring.push(record.data(), record.size()));
+
+        out.clear();
+        assert(ring.pop(out));
+        assert(out == record);
+        assert(ring.empty());
+    }
+}
+
+static void test_full() {
+    llama_output_ring ring;
+    ring.init(64);
+
+    // 5 records of 2 + 10 bytes fit, a sixth does not until one is read
+    for (int i = 0; i < 5; i++) {
+        assert(ring.push("0123456789", 10));
+    }
+    assert(ring.space() == 4);
+    assert(!ring.push("0123456789", 10));
+
+    std::string out;
+    assert(ring.pop(out));
+    assert(ring.push("0123456789", 10));
+
+    // pop appends, the records read so far stay in out
+    while (ring.pop(out)) {
+    }
+    assert(out.size() == 6 * 10);
+
+    assert(ring.push("abc", 3));
+    ring.discard();
+    assert(ring.empty());
+    assert(!ring.pop(out));
+}
+
+static void test_threads() {
+    llama_output_ring ring;
+    ring.init(256);
+
+    const int n_records = 100000;
+
+    std::thread producer([&] {
+        for (int i = 0; i < n_records; i++) {
+            const std::string record = std::to_string(i);
+            while (!ring.push(record.data(), record.size())) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    std::string out;
+    for (int i = 0; i < n_records;) {
+        out.clear();
+        if (!ring.pop(out)) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        assert(out == std::to_string(i));
+        i++;
+    }
+
+    producer.join();
+    assert(ring.empty());
+}
+
+int main() {
+    test_capacity();
+    test_wrap();
+    test_full();
+    test_threads();
+
+    printf("test_ring: ok\n");
+    return 0;
+}
@@ -0,0 +1,130 @@
+// stop strings have to end a reply however the text is split into pieces
+#undef NDEBUG
+#include "stop.hpp"
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// feeds the pieces like the engine does: the reply ends right before the first stop string it
+// completes, and the bytes that could still begin one are held back at the end of every piece
+struct stop_result {
+    std::string reply;
+    bool stopped = false;
+    std::vector<uint32_t> held; // bytes held back after each piece
+};
+
+static stop_result feed(const llama_stop_automaton & stop, const std::vector<std::string> & pieces) {
+    stop_result result;
+    int32_t state = 0;
+
+    for (auto & piece : pieces) {
+        for (unsigned char c : piece) {
+            result.reply += (char) c;
+            state = stop.next(state, c);
+
+            if (const uint32_t n_match = stop.match(state)) {
+                result.reply.resize(result.reply.size() - n_match);
+                result.stopped = true;
+                return result;
+            }
+        }
+
+        result.held.push_back(stop.depth(state));
+    }
+
+    return result;
+}
+
+// every way of cutting text into two or three pieces
+static std::vector<std::vector<std::string>> splits(const std::string & text) {
+    std::vector<std::vector<std::string>> out = {{text}};
+
+    for (size_t i = 0; i <= text.size(); i++) {
+        out.push_back({text.substr(0, i), text.substr(i)});
+
+        for (size_t j = i; j <= text.size(); j++) {
+            out.push_back({text.substr(0, i), text.substr(i, j - i), text.substr(j)});
+        }
+    }
+
+    return out;
+}
+
+static void test_split_anywhere() {
+    const llama_stop_automaton stop({"</answer>", "\nUser:"});
+    assert(stop.max_length == 9);
+
+    for (auto & pieces : splits("The answer is 42.</answer> and more")) {
+        auto result = feed(stop, pieces);
+        assert(result.stopped);
+        assert(result.reply == "The answer is 42.");
+    }
+
+    for (auto & pieces : splits("Hello\nUser: again")) {
+        auto result = feed(stop, pieces);
+        assert(result.stopped);
+        assert(result.reply == "Hello");
+    }
+}
+
+static void test_no_match() {
+    const llama_stop_automaton stop({"</answer>"});
+
+    for (auto & pieces : splits("a </answ> b </answer")) {
+        auto result = feed(stop, pieces);
+        assert(!result.stopped);
+        assert(result.reply == "a </answ> b </answer");
+    }
+}
+
+static void test_held_back() {
+    const llama_stop_automaton stop({"STOP"});
+
+    // a piece ending in a prefix of the stop string holds that prefix back, until the next piece
+    // shows it does not continue into the stop string
+    auto result = feed(stop, {"abc ST", "x", "S", "TO"});
+    assert(!result.stopped);
+    assert((result.held == std::vector<uint32_t>{2, 0, 1, 3}));
+
+    result = feed(stop, {"abc ST", "OP tail"});
+    assert(result.stopped);
+    assert(result.reply == "abc ");
+}
+
+static void test_overlapping() {
+    // the longest stop string ending at a byte is cut, and a stop string inside another one counts
+    const llama_stop_automaton stop({"ab", "xaby", "b"});
+
+    auto result = feed(stop, {"x", "a", "b", "y"});
+    assert(result.stopped);
+    assert(result.reply == "x");
+
+    // a failed partial match falls back to the longest suffix that still begins a stop string
+    const llama_stop_automaton repeat({"aab"});
+    result = feed(repeat, {"aa", "a", "ab"});
+    assert(result.stopped);
+    assert(result.reply == "aa");
+}
+
+static void test_multibyte() {
+    // stop strings are matched on bytes, so a split inside a UTF-8 character still matches
+    const llama_stop_automaton stop({"終わり"});
+
+    for (auto & pieces : splits("答え終わり!")) {
+        auto result = feed(stop, pieces);
+        assert(result.stopped);
+        assert(result.reply == "答え");
+    }
+}
+
+int main() {
+    test_split_anywhere();
+    test_no_match();
+    test_held_back();
+    test_overlapping();
+    test_multibyte();
+
+    printf("test_stop: ok\n");
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef TOKEN_CACHE_HPP
+#define TOKEN_CACHE_HPP
+
+#include "llama.h"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Tokens of rendered text segments, keyed by a hash of the text and checked
+/// against the text itself on a hit. Holds at most capacity tokens, the least
+/// recently used segments are dropped first. Thread safe, its mutex is never
+/// held while calling out.
+struct llama_token_cache {
+    size_t capacity = 65536; // tokens, 0 disables the cache
+
+    /// Appends the cached tokens of the segment to tokens, false if it is not cached
+    bool get(uint64_t key, const char * text, size_t length, bool add_special, std::vector<llama_token> & tokens) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = index.find(key);
+        if (it == index.end() || it->second->add_special != add_special || it->second->text.compare(0, std::string::npos, text, length) != 0) {
+            return false;
+        }
+
+        lru.splice(lru.begin(), lru, it->second);
+        tokens.insert(tokens.end(), it->second->tokens.begin(), it->second->tokens.end());
+
+        return true;
+    }
+
+    /// False if the segment was not added, because it is cached already or too large
+    bool put(uint64_t key, const char * text, size_t length, bool add_special, const llama_token * tokens, size_t n_tokens) {
+        if (n_tokens > capacity) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (index.count(key) > 0) {
+            return false;
+        }
+
+        while (size + n_tokens > capacity) {
+            size -= lru.back().tokens.size();
+            index.erase(lru.back().key);
+            lru.pop_back();
+        }
+
+        lru.push_front({key, std::string(text, length), add_special, std::vector<llama_token>(tokens, tokens + n_tokens)});
+        index[key] = lru.begin();
+        size += n_tokens;
+
+        return true;
+    }
+
+private:
+    struct entry {
+        uint64_t key;
+        std::string text; // the segment, a hit on a colliding hash must not hand out its tokens
+        bool add_special;
+        std::vector<llama_token> tokens;
+    };
+
+    std::mutex mutex;
+    std::list<entry> lru;
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+    size_t size = 0; // tokens held
+};
+
+#endif
@@ -0,0 +1,762 @@
+#include "vector_store.hpp"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <thread>
+
+#if defined(__AVX2__) && defined(__FMA__)
+    #include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    #include <arm_neon.h>
+#endif
+
+#if !defined(_WIN32)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+static const uint32_t VECTOR_STORE_MAGIC = 0x5356534c; // 'LSVS'
+static const uint32_t VECTOR_STORE_VERSION = 1;
+
+struct vector_store_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_dim;
+    uint32_t quantized;
+    uint64_t n_rows;
+    uint64_t n_lists;
+};
+
+// sections start on 64 byte boundaries, so mapped rows are as aligned as owned ones
+struct vector_store_layout {
+    size_t ids;
+    size_t scales;
+    size_t data;
+    size_t centroids;
+    size_t offsets;
+    size_t end;
+};
+
+static size_t align_up(size_t n) {
+    return (n + 63) & ~(size_t) 63;
+}
+
+static vector_store_layout layout_of(const vector_store_header & header) {
+    vector_store_layout layout;
+
+    layout.ids = align_up(sizeof(header));
+    layout.scales = align_up(layout.ids + header.n_rows * sizeof(int64_t));
+    layout.data = align_up(layout.scales + (header.quantized ? header.n_rows * sizeof(float) : 0));
+    layout.centroids = align_up(layout.data + header.n_rows * header.n_dim * (header.quantized ? sizeof(int8_t) : sizeof(float)));
+    layout.offsets = align_up(layout.centroids + header.n_lists * header.n_dim * sizeof(float));
+    layout.end = layout.offsets + (header.n_lists > 0 ? (header.n_lists + 1) * sizeof(uint64_t) : 0);
+
+    return layout;
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+static float hsum(__m256 v) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+#endif
+
+static float dot_f32(const float * a, const float * b, size_t n) {
+    size_t i = 0;
+    float sum = 0.0f;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    sum = hsum(_mm256_add_ps(acc0, acc1));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+#else
+    // independent lanes let the compiler vectorize without reordering a single sum
+    float acc[8] = {};
+    for (; i + 8 <= n; i += 8) {
+        for (size_t j = 0; j < 8; j++) {
+            acc[j] += a[i + j] * b[i + j];
+        }
+    }
+    for (float lane : acc) {
+        sum += lane;
+    }
+#endif
+
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+
+    return sum;
+}
+
+// the query stays in floats, only the rows are quantized
+static float dot_i8(const float * a, const int8_t * b, size_t n) {
+    size_t i = 0;
+    float sum = 0.0f;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        const __m128i q = _mm_loadu_si128((const __m128i *) (b + i));
+        const __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q));
+        const __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(q, 8)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), lo, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), hi, acc1);
+    }
+    sum = hsum(_mm256_add_ps(acc0, acc1));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8) {
+        const int16x8_t q = vmovl_s8(vld1_s8(b + i));
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vcvtq_f32_s32(vmovl_s16(vget_low_s16(q))));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vcvtq_f32_s32(vmovl_high_s16(q)));
+    }
+    sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+#else
+    // independent lanes let the compiler vectorize without reordering a single sum
+    float acc[8] = {};
+    for (; i + 8 <= n; i += 8) {
+        for (size_t j = 0; j < 8; j++) {
+            acc[j] += a[i + j] * b[i + j];
+        }
+    }
+    for (float lane : acc) {
+        sum += lane;
+    }
+#endif
+
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+
+    return sum;
+}
+
+static void normalize(float * v, size_t n) {
+    const float norm = std::sqrt(dot_f32(v, v, n));
+    if (norm > 0.0f) {
+        for (size_t i = 0; i < n; i++) {
+            v[i] /= norm;
+        }
+    }
+}
+
+static uint32_t nearest(const float * centroids, uint32_t n_lists, size_t n_dim, const float * v) {
+    uint32_t best = 0;
+    float best_score = -INFINITY;
+
+    for (uint32_t c = 0; c < n_lists; c++) {
+        const float score = dot_f32(centroids + c * n_dim, v, n_dim);
+        if (score > best_score) {
+            best = c;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+// threads kept for the life of a store, so a search does not pay for starting them. Any number of
+// callers can hand it work at once, a task never waits on another
+struct vector_worker_pool {
+    explicit vector_worker_pool(size_t n_workers) {
+        for (size_t i = 0; i < n_workers; i++) {
+            workers.emplace_back([this] { loop(); });
+        }
+    }
+
+    ~vector_worker_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        cv.notify_all();
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    // threads a call can use, the caller's own included
+    size_t size() const { return workers.size() + 1; }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+
+        cv.notify_one();
+    }
+
+private:
+    void loop() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return stopping || !tasks.empty(); });
+
+            if (tasks.empty()) {
+                return;
+            }
+
+            auto task = std::move(tasks.front());
+            tasks.pop_front();
+
+            lock.unlock();
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+};
+
+// runs fn(begin, end) on one chunk of the n items per thread of the pool, no chunk smaller than min_chunk
+template <typename F>
+static void parallel_for(vector_worker_pool & pool, size_t n, size_t min_chunk, F fn) {
+    const size_t n_threads = std::max<size_t>(1, std::min<size_t>(pool.size(), n / min_chunk));
+    if (n_threads == 1) {
+        fn(0, n);
+        return;
+    }
+
+    const size_t chunk = (n + n_threads - 1) / n_threads;
+
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    size_t n_pending = n_threads - 1;
+
+    for (size_t t = 1; t < n_threads; t++) {
+        pool.submit([&, begin = std::min(n, t * chunk), end = std::min(n, (t + 1) * chunk)] {
+            fn(begin, end);
+
+            // notified under the lock, the caller cannot return and take the state with it before
+            std::lock_guard<std::mutex> lock(done_mutex);
+            if (--n_pending == 0) {
+                done_cv.notify_one();
+            }
+        });
+    }
+
+    fn(0, std::min(n, chunk));
+
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done_cv.wait(lock, [&] { return n_pending == 0; });
+}
+
+struct vector_hit {
+    float score;
+    size_t row;
+};
+
+// min-heap on the score, so the worst of the k best is on top
+static bool hit_greater(const vector_hit & a, const vector_hit & b) {
+    return a.score > b.score;
+}
+
+static void hit_push(std::vector<vector_hit> & heap, size_t k, vector_hit hit) {
+    if (heap.size() < k) {
+        heap.push_back(hit);
+        std::push_heap(heap.begin(), heap.end(), hit_greater);
+    }
+    else if (hit.score > heap.front().score) {
+        std::pop_heap(heap.begin(), heap.end(), hit_greater);
+        heap.back() = hit;
+        std::push_heap(heap.begin(), heap.end(), hit_greater);
+    }
+}
+
+llama_vector_store::llama_vector_store(uint32_t dim, bool quantized) : n_dim(dim), quantized(quantized) {
+    point();
+}
+
+llama_vector_store::~llama_vector_store() {
+#if !defined(_WIN32)
+    if (addr != nullptr) {
+        munmap(addr, length);
+    }
+#endif
+}
+
+// the pool is started by the first scan
+vector_worker_pool & llama_vector_store::workers() {
+    std::call_once(pool_started, [&] {
+        pool = std::make_unique<vector_worker_pool>(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    });
+
+    return *pool;
+}
+
+// points the rows at the owned vectors
+void llama_vector_store::point() {
+    ids = own_ids.data();
+    scales = quantized ? own_scales.data() : nullptr;
+    data = quantized ? (const void *) own_i8.data() : (const void *) own_f32.data();
+    centroids = own_centroids.data();
+    offsets = n_lists > 0 ? own_offsets.data() : nullptr;
+}
+
+// copies the rows out of the opened file before they change
+void llama_vector_store::own() {
+    if (addr == nullptr && buffer.empty()) {
+        return;
+    }
+
+    own_ids.assign(ids, ids + n_rows);
+    if (quantized) {
+        own_scales.assign(scales, scales + n_rows);
+        own_i8.assign((const int8_t *) data, (const int8_t *) data + n_rows * n_dim);
+    }
+    else {
+        own_f32.assign((const float *) data, (const float *) data + n_rows * n_dim);
+    }
+
+    own_centroids.assign(centroids, centroids + (size_t) n_lists * n_dim);
+    own_offsets.assign(offsets, offsets + (n_lists > 0 ? n_lists + 1 : 0));
+
+#if !defined(_WIN32)
+    if (addr != nullptr) {
+        munmap(addr, length);
+        addr = nullptr;
+    }
+#endif
+    buffer.clear();
+    buffer.shrink_to_fit();
+
+    point();
+}
+
+float llama_vector_store::score(const float * query, size_t i) const {
+    if (quantized) {
+        return scales[i] * dot_i8(query, (const int8_t *) data + i * n_dim, n_dim);
+    }
+
+    return dot_f32(query, (const float *) data + i * n_dim, n_dim);
+}
+
+void llama_vector_store::row(size_t i, float * out) const {
+    if (quantized) {
+        const int8_t * q = (const int8_t *) data + i * n_dim;
+        for (size_t d = 0; d < n_dim; d++) {
+            out[d] = scales[i] * q[d];
+        }
+    }
+    else {
+        memcpy(out, (const float *) data + i * n_dim, n_dim * sizeof(float));
+    }
+}
+
+size_t llama_vector_store::size() {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return n_rows;
+}
+
+void llama_vector_store::add(const float * vectors, const int64_t * new_ids, size_t n) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+
+    own();
+
+    own_ids.insert(own_ids.end(), new_ids, new_ids + n);
+
+    if (quantized) {
+        own_i8.resize((n_rows + n) * n_dim);
+        own_scales.resize(n_rows + n);
+
+        for (size_t i = 0; i < n; i++) {
+            const float * v = vectors + i * n_dim;
+
+            float max = 0.0f;
+            for (size_t d = 0; d < n_dim; d++) {
+                max = std::max(max, std::fabs(v[d]));
+            }
+
+            const float scale = max / 127.0f;
+            const float inv = scale > 0.0f ? 1.0f / scale : 0.0f;
+
+            int8_t * q = own_i8.data() + (n_rows + i) * n_dim;
+            for (size_t d = 0; d < n_dim; d++) {
+                q[d] = (int8_t) std::lround(v[d] * inv);
+            }
+
+            own_scales[n_rows + i] = scale;
+        }
+    }
+    else {
+        own_f32.insert(own_f32.end(), vectors, vectors + n * n_dim);
+    }
+
+    n_rows += n;
+
+    point();
+}
+
+bool llama_vector_store::build_index(uint32_t n_lists_new) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+
+    if (n_lists_new > n_rows) {
+        fprintf(stderr, "cannot cluster %zu vectors into %u lists\n", n_rows, n_lists_new);
+        return false;
+    }
+
+    own();
+
+    if (n_lists_new == 0) {
+        n_lists = 0;
+        own_centroids.clear();
+        own_offsets.clear();
+        point();
+        return true;
+    }
+
+    // spherical k-means on a sample, a few dozen rows per list are plenty
+    std::mt19937 rng(42);
+
+    std::vector<size_t> sample(n_rows);
+    std::iota(sample.begin(), sample.end(), 0);
+    std::shuffle(sample.begin(), sample.end(), rng);
+    sample.resize(std::min<size_t>(n_rows, (size_t) n_lists_new * 64));
+
+    std::vector<float> points(sample.size() * n_dim);
+    for (size_t i = 0; i < sample.size(); i++) {
+        row(sample[i], points.data() + i * n_dim);
+    }
+
+    std::vector<float> cents(points.begin(), points.begin() + (size_t) n_lists_new * n_dim);
+    for (uint32_t c = 0; c < n_lists_new; c++) {
+        normalize(cents.data() + c * n_dim, n_dim);
+    }
+
+    std::vector<uint32_t> assigned(sample.size());
+    std::vector<float> sums;
+    std::vector<size_t> counts;
+
+    for (int iter = 0; iter < 10; iter++) {
+        parallel_for(workers(), sample.size(), 256, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                assigned[i] = nearest(cents.data(), n_lists_new, n_dim, points.data() + i * n_dim);
+            }
+        });
+
+        sums.assign(cents.size(), 0.0f);
+        counts.assign(n_lists_new, 0);
+
+        for (size_t i = 0; i < sample.size(); i++) {
+            float * sum = sums.data() + assigned[i] * n_dim;
+            for (size_t d = 0; d < n_dim; d++) {
+                sum[d] += points[i * n_dim + d];
+            }
+            counts[assigned[i]]++;
+        }
+
+        for (uint32_t c = 0; c < n_lists_new; c++) {
+            float * cent = cents.data() + c * n_dim;
+
+            // an empty list restarts from a random row
+            const float * src = counts[c] > 0 ? sums.data() + c * n_dim : points.data() + (rng() % sample.size()) * n_dim;
+            std::copy(src, src + n_dim, cent);
+            normalize(cent, n_dim);
+        }
+    }
+
+    // every row goes to its closest list, then the rows are sorted by list
+    std::vector<uint32_t> lists(n_rows);
+    parallel_for(workers(), n_rows, 1024, [&](size_t begin, size_t end) {
+        std::vector<float> v(n_dim);
+        for (size_t i = begin; i < end; i++) {
+            row(i, v.data());
+            lists[i] = nearest(cents.data(), n_lists_new, n_dim, v.data());
+        }
+    });
+
+    std::vector<uint64_t> new_offsets(n_lists_new + 1, 0);
+    for (auto list : lists) {
+        new_offsets[list + 1]++;
+    }
+    for (uint32_t c = 0; c < n_lists_new; c++) {
+        new_offsets[c + 1] += new_offsets[c];
+    }
+
+    std::vector<size_t> order(n_rows);
+    {
+        std::vector<uint64_t> next(new_offsets.begin(), new_offsets.end() - 1);
+        for (size_t i = 0; i < n_rows; i++) {
+            order[next[lists[i]]++] = i;
+        }
+    }
+
+    std::vector<int64_t> sorted_ids(n_rows);
+    for (size_t i = 0; i < n_rows; i++) {
+        sorted_ids[i] = own_ids[order[i]];
+    }
+    own_ids.swap(sorted_ids);
+
+    if (quantized) {
+        std::vector<int8_t> sorted(own_i8.size());
+        std::vector<float> sorted_scales(n_rows);
+        for (size_t i = 0; i < n_rows; i++) {
+            std::copy_n(own_i8.data() + order[i] * n_dim, n_dim, sorted.data() + i * n_dim);
+            sorted_scales[i] = own_scales[order[i]];
+        }
+        own_i8.swap(sorted);
+        own_scales.swap(sorted_scales);
+    }
+    else {
+        std::vector<float> sorted(own_f32.size());
+        for (size_t i = 0; i < n_rows; i++) {
+            std::copy_n(own_f32.data() + order[i] * n_dim, n_dim, sorted.data() + i * n_dim);
+        }
+        own_f32.swap(sorted);
+    }
+
+    n_lists = n_lists_new;
+    own_centroids.swap(cents);
+    own_offsets.swap(new_offsets);
+
+    point();
+
+    return true;
+}
+
+size_t llama_vector_store::search(const float * query, size_t k, uint32_t n_probe, int64_t * out_ids, float * out_scores) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    if (k == 0 || n_rows == 0) {
+        return 0;
+    }
+
+    // the row ranges to scan: the closest lists, and the rows added since the index was built
+    std::vector<std::pair<size_t, size_t>> ranges;
+
+    if (n_lists > 0) {
+        std::vector<vector_hit> closest;
+        for (uint32_t c = 0; c < n_lists; c++) {
+            hit_push(closest, std::clamp<uint32_t>(n_probe, 1, n_lists), {dot_f32(centroids + c * n_dim, query, n_dim), c});
+        }
+
+        for (auto & list : closest) {
+            ranges.push_back({offsets[list.row], offsets[list.row + 1]});
+        }
+
+        ranges.push_back({offsets[n_lists], n_rows});
+    }
+    else {
+        ranges.push_back({0, n_rows});
+    }
+
+    size_t total = 0;
+    for (auto & range : ranges) {
+        total += range.second - range.first;
+    }
+
+    std::vector<vector_hit> heap;
+    std::mutex heap_mutex;
+
+    // large scans are split across threads, each keeps its own k best
+    parallel_for(workers(), total, 16384, [&](size_t begin, size_t end) {
+        std::vector<vector_hit> local;
+        local.reserve(k);
+
+        size_t pos = 0;
+        for (auto & range : ranges) {
+            const size_t n = range.second - range.first;
+            const size_t from = std::max(pos, begin);
+            const size_t to = std::min(pos + n, end);
+
+            for (size_t i = from; i < to; i++) {
+                const size_t r = range.first + (i - pos);
+                hit_push(local, k, {score(query, r), r});
+            }
+
+            pos += n;
+        }
+
+        std::lock_guard<std::mutex> lock(heap_mutex);
+        for (auto & hit : local) {
+            hit_push(heap, k, hit);
+        }
+    });
+
+    std::sort_heap(heap.begin(), heap.end(), hit_greater);
+
+    for (size_t i = 0; i < heap.size(); i++) {
+        out_ids[i] = ids[heap[i].row];
+        out_scores[i] = heap[i].score;
+    }
+
+    return heap.size();
+}
+
+bool llama_vector_store::parse(const uint8_t * base, size_t size) {
+    vector_store_header header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+
+    memcpy(&header, base, sizeof(header));
+    if (header.magic != VECTOR_STORE_MAGIC || header.version != VECTOR_STORE_VERSION) {
+        return false;
+    }
+
+    // bounded by the file size before the layout multiplies them
+    if (header.n_dim == 0 || header.n_dim > 65536 || header.n_rows > size || header.n_lists > header.n_rows || header.n_lists > UINT32_MAX) {
+        return false;
+    }
+
+    const vector_store_layout layout = layout_of(header);
+    if (layout.end != size) {
+        return false;
+    }
+
+    n_dim = header.n_dim;
+    quantized = header.quantized != 0;
+    n_rows = header.n_rows;
+    n_lists = header.n_lists;
+
+    ids = (const int64_t *) (base + layout.ids);
+    scales = quantized ? (const float *) (base + layout.scales) : nullptr;
+    data = base + layout.data;
+    centroids = (const float *) (base + layout.centroids);
+    offsets = n_lists > 0 ? (const uint64_t *) (base + layout.offsets) : nullptr;
+
+    if (n_lists > 0) {
+        if (offsets[0] != 0 || offsets[n_lists] > n_rows) {
+            return false;
+        }
+
+        for (uint32_t c = 0; c < n_lists; c++) {
+            if (offsets[c] > offsets[c + 1]) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+std::unique_ptr<llama_vector_store> llama_vector_store::open(const std::string & path) {
+    auto store = std::make_unique<llama_vector_store>(0, false);
+
+#if defined(_WIN32)
+    std::ifstream in(std::filesystem::u8path(path), std::ios::binary | std::ios::ate);
+    if (!in) {
+        return nullptr;
+    }
+
+    store->buffer.resize(in.tellg());
+    in.seekg(0);
+    if (!in.read((char *) store->buffer.data(), store->buffer.size())) {
+        return nullptr;
+    }
+
+    if (!store->parse(store->buffer.data(), store->buffer.size())) {
+        fprintf(stderr, "invalid vector store %s\n", path.c_str());
+        return nullptr;
+    }
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    store->length = st.st_size;
+    store->addr = mmap(nullptr, store->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (store->addr == MAP_FAILED) {
+        store->addr = nullptr;
+        return nullptr;
+    }
+
+    if (!store->parse((const uint8_t *) store->addr, store->length)) {
+        fprintf(stderr, "invalid vector store %s\n", path.c_str());
+        return nullptr;
+    }
+#endif
+
+    return store;
+}
+
+bool llama_vector_store::save(const std::string & path) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    const vector_store_header header = { VECTOR_STORE_MAGIC, VECTOR_STORE_VERSION, n_dim, quantized, n_rows, n_lists };
+    const vector_store_layout layout = layout_of(header);
+
+    // write next to the target and rename so readers never see a partial file
+    const std::string tmp_path = path + ".tmp";
+
+    {
+        std::ofstream out(std::filesystem::u8path(tmp_path), std::ios::binary | std::ios::trunc);
+        if (!out) {
+            fprintf(stderr, "failed to open %s for writing\n", tmp_path.c_str());
+            return false;
+        }
+
+        size_t written = 0;
+        auto write_at = [&](size_t offset, const void * src, size_t size) {
+            static const char zeros[64] = {};
+            out.write(zeros, offset - written);
+            out.write((const char *) src, size);
+            written = offset + size;
+        };
+
+        write_at(0, &header, sizeof(header));
+        write_at(layout.ids, ids, n_rows * sizeof(int64_t));
+        write_at(layout.scales, scales, quantized ? n_rows * sizeof(float) : 0);
+        write_at(layout.data, data, n_rows * n_dim * (quantized ? sizeof(int8_t) : sizeof(float)));
+        write_at(layout.centroids, centroids, (size_t) n_lists * n_dim * sizeof(float));
+        write_at(layout.offsets, offsets, n_lists > 0 ? (n_lists + 1) * sizeof(uint64_t) : 0);
+
+        if (!out) {
+            fprintf(stderr, "failed to write %s\n", tmp_path.c_str());
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(std::filesystem::u8path(tmp_path), std::filesystem::u8path(path), ec);
+    if (ec) {
+        fprintf(stderr, "failed to rename %s: %s\n", tmp_path.c_str(), ec.message().c_str());
+        std::filesystem::remove(std::filesystem::u8path(tmp_path), ec);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,88 @@
+#ifndef VECTOR_STORE_HPP
+#define VECTOR_STORE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+/// Vectors of a fixed width in one contiguous block, as floats or as int8 rows
+/// with a scale each, labelled with caller ids. Scores are dot products, so
+/// unit length vectors score by cosine similarity.
+///
+/// build_index clusters the rows into an IVF index, searches then scan only
+/// the lists closest to the query. Rows added afterwards are scanned on every
+/// search until the index is rebuilt.
+///
+/// Opened files are memory-mapped where available, and copied out of the
+/// mapping on the first change. Searches run concurrently, changes take the
+/// store exclusively.
+struct vector_worker_pool;
+
+struct llama_vector_store {
+    llama_vector_store(uint32_t dim, bool quantized);
+    ~llama_vector_store();
+
+    llama_vector_store(const llama_vector_store &) = delete;
+    llama_vector_store & operator=(const llama_vector_store &) = delete;
+
+    static std::unique_ptr<llama_vector_store> open(const std::string & path);
+
+    bool save(const std::string & path);
+
+    uint32_t dim() const { return n_dim; }
+
+    size_t size();
+
+    /// Adds n rows of dim floats
+    void add(const float * vectors, const int64_t * ids, size_t n);
+
+    /// Clusters the rows into n_lists lists, 0 drops the index
+    bool build_index(uint32_t n_lists);
+
+    /// Writes the k best rows, best first, and returns how many were written
+    size_t search(const float * query, size_t k, uint32_t n_probe, int64_t * ids, float * scores);
+
+private:
+    uint32_t n_dim;
+    bool quantized;
+
+    size_t n_rows = 0;
+    uint32_t n_lists = 0; // rows before offsets[n_lists] are sorted by list, the rest are not indexed
+
+    // the rows, either in the vectors below or in the mapped file
+    const int64_t * ids = nullptr;
+    const float * scales = nullptr; // quantized rows only
+    const void * data = nullptr;
+    const float * centroids = nullptr;
+    const uint64_t * offsets = nullptr;
+
+    std::vector<int64_t> own_ids;
+    std::vector<float> own_scales;
+    std::vector<float> own_f32;
+    std::vector<int8_t> own_i8;
+    std::vector<float> own_centroids;
+    std::vector<uint64_t> own_offsets;
+
+    void * addr = nullptr;
+    size_t length = 0;
+    std::vector<uint8_t> buffer;
+
+    std::shared_mutex mutex;
+
+    // threads that split large scans, started on first use
+    std::unique_ptr<vector_worker_pool> pool;
+    std::once_flag pool_started;
+
+    vector_worker_pool & workers();
+    bool parse(const uint8_t * base, size_t size);
+    void own();
+    void point();
+    float score(const float * query, size_t row) const;
+    void row(size_t i, float * out) const;
+};
+
+#endif